@@ -0,0 +1,140 @@
+// The MIT License (MIT)
+//
+// Copyright (c) 2017 THINK BIG LABS S.L.
+// Author: alvarolb@gmail.com (Alvaro Luis Bustamante)
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+// Decode-heavy benchmark: decode the same message into a new document and discard it, with each of
+// the allocators, and report the time per document.
+
+#include <iostream>
+#include <iomanip>
+#include <chrono>
+#include <cstdlib>
+#include "../src/pson.h"
+
+using namespace protoson;
+using namespace std;
+
+dynamic_memory_allocator alloc;
+memory_allocator&protoson::pool = alloc;
+
+class memory_writer : public pson_encoder {
+private:
+    uint8_t* buffer_;
+    size_t size_;
+public:
+    memory_writer(uint8_t *buffer, size_t size) : buffer_(buffer), size_(size){
+    }
+
+protected:
+    virtual bool write(const void *buffer, size_t size) {
+        if(written_+size<=size_){
+            memcpy(&buffer_[written_], buffer, size);
+            return pson_encoder::write(buffer, size);
+        }
+        return false;
+    }
+};
+
+class memory_reader : public pson_decoder {
+private:
+    const uint8_t* buffer_;
+    size_t size_;
+public:
+    memory_reader(const uint8_t *buffer, size_t size) : buffer_(buffer), size_(size){
+    }
+
+protected:
+    virtual bool read(void *buffer, size_t size) {
+        if(read_+size<=size_){
+            memcpy(buffer, &buffer_[read_], size);
+            return pson_decoder::read(buffer, size);
+        }
+        return false;
+    }
+};
+
+// decode once into a document that uses the given allocator, returning the nanoseconds per document
+static double run(memory_allocator& allocator, arena_memory_allocator* arena, const uint8_t* message, size_t size, unsigned long iterations){
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    for(unsigned long i=0; i<iterations; i++){
+        {
+            pson document;
+            document.set_allocator(allocator);
+            memory_reader reader(message, size);
+            if(!reader.decode(document)){
+                cerr << "decoding failed" << endl;
+                exit(1);
+            }
+        }
+        if(arena!=NULL){
+            arena->reset();
+        }
+    }
+    chrono::duration<double, nano> elapsed = chrono::steady_clock::now() - start;
+    return elapsed.count() / iterations;
+}
+
+static void report(const char* name, double nanoseconds, double baseline){
+    cout << setw(12) << name << setw(14) << fixed << setprecision(1) << nanoseconds
+         << setw(9) << setprecision(2) << baseline / nanoseconds << "x" << endl;
+}
+
+int main(int argc, char* argv[]) {
+    unsigned long iterations = argc > 1 ? strtoul(argv[1], NULL, 10) : 200000;
+
+    // a typical device message
+    pson message;
+    message["device"] = "temperature-sensor-0042";
+    message["timestamp"] = 1760781600;
+    message["online"] = true;
+    pson_array& readings = message["readings"];
+    for(int i=0; i<16; i++){
+        pson_object& reading = readings.add_object();
+        reading["sensor"] = "a sensor name long enough to allocate";
+        reading["value"] = 20.5 + i;
+        reading["unit"] = "celsius";
+    }
+    pson_object& location = message["location"];
+    location["latitude"] = 40.4168;
+    location["longitude"] = -3.7038;
+
+    uint8_t buffer[4096];
+    memory_writer writer(buffer, sizeof(buffer));
+    writer.encode(message);
+    size_t size = writer.bytes_written();
+
+    dynamic_memory_allocator dynamic;
+    slab_memory_allocator slab;
+    arena_memory_allocator arena(8192);
+
+    // warm up the allocators
+    run(slab, NULL, buffer, size, 100);
+    run(arena, &arena, buffer, size, 100);
+
+    cout << "message: " << size << " bytes, " << iterations << " iterations" << endl;
+    cout << setw(12) << "allocator" << setw(14) << "ns/document" << setw(10) << "speedup" << endl;
+    double baseline = run(dynamic, NULL, buffer, size, iterations);
+    report("malloc", baseline, baseline);
+    report("slab", run(slab, NULL, buffer, size, iterations), baseline);
+    report("arena", run(arena, &arena, buffer, size, iterations), baseline);
+    return 0;
+}
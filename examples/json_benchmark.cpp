@@ -0,0 +1,118 @@
+// The MIT License (MIT)
+//
+// Copyright (c) 2017 THINK BIG LABS S.L.
+// Author: alvarolb@gmail.com (Alvaro Luis Bustamante)
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+// JSON ingestion benchmark: converts a large JSON document into pson by parsing a nlohmann::json
+// document and converting it (to_pson), by building pson from nlohmann's SAX events, and with the
+// native json_parser. Every method runs in its own process, and reports the peak resident memory
+// added while converting (Linux).
+
+#include <iostream>
+#include <iomanip>
+#include <sstream>
+#include <fstream>
+#include <string>
+#include <chrono>
+#include <cstdlib>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "../src/pson.h"
+#include "../src/util/json_decoder.hpp"
+#include "../src/util/json_parser.hpp"
+
+using namespace protoson;
+using namespace std;
+
+dynamic_memory_allocator alloc;
+memory_allocator&protoson::pool = alloc;
+
+// reads a field of /proc/self/status, in MB
+static double status_field(const string& field){
+    ifstream status("/proc/self/status");
+    string line;
+    while(getline(status, line)){
+        if(line.compare(0, field.size(), field)==0){
+            return strtod(line.c_str() + field.size() + 1, NULL) / 1024;
+        }
+    }
+    return 0;
+}
+
+static void run(const string& method, const string& json){
+    // reset the peak resident memory, so it only measures the conversion
+    ofstream("/proc/self/clear_refs") << "5";
+    double initial = status_field("VmRSS");
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    pson value;
+    bool parsed = false;
+    if(method=="to_pson"){
+        nlohmann::json document = nlohmann::json::parse(json);
+        parsed = json_decoder::parse(document, value);
+    }else if(method=="sax"){
+        parsed = json_decoder::parse_sax(json, value);
+    }else{
+        json_parser parser;
+        parsed = parser.parse(json.data(), json.size(), value);
+    }
+    chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+    if(!parsed){
+        cerr << method << " failed" << endl;
+        exit(1);
+    }
+    cout << setw(10) << method << setw(12) << fixed << setprecision(1) << json.size() / elapsed.count() / (1 << 20)
+         << setw(12) << status_field("VmHWM") - initial << setw(12) << setprecision(3) << elapsed.count() << endl;
+}
+
+// run the benchmark in a child process, so each method starts from the same memory
+static void fork_run(const string& method, const string& json){
+    pid_t pid = fork();
+    if(pid==0){
+        run(method, json);
+        exit(0);
+    }
+    int status;
+    waitpid(pid, &status, 0);
+}
+
+int main(int argc, char* argv[]) {
+    unsigned long records = argc > 1 ? strtoul(argv[1], NULL, 10) : 300000;
+
+    // a large array of records, like a log or a time series export
+    ostringstream stream;
+    stream << '[';
+    for(unsigned long i=0; i<records; i++){
+        if(i>0) stream << ',';
+        stream << "{\"id\":" << i << ",\"device\":\"temperature-sensor-0042\",\"value\":" << 20.5 + (i % 100) / 10.0
+               << ",\"offset\":" << -(long)(i % 50) << ",\"tags\":[\"edge\",\"a longer tag value\"],\"ok\":"
+               << (i % 2 ? "true" : "false") << ",\"note\":null}";
+    }
+    stream << ']';
+    string json = stream.str();
+
+    cout << records << " records, " << json.size() / (1 << 20) << " MB" << endl;
+    cout << setw(10) << "method" << setw(12) << "MB/s" << setw(12) << "peak MB" << setw(12) << "seconds" << endl;
+    cout.flush();
+    fork_run("to_pson", json);
+    fork_run("sax", json);
+    fork_run("native", json);
+    return 0;
+}
@@ -0,0 +1,151 @@
+// The MIT License (MIT)
+//
+// Copyright (c) 2017 THINK BIG LABS S.L.
+// Author: alvarolb@gmail.com (Alvaro Luis Bustamante)
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+// Bulk conversion benchmark: decode a large pson document with malloc, with mmap regions and with
+// huge page backed mmap regions. Every allocator runs in its own process, and reports the resident
+// memory added by the decoded document (Linux).
+
+#include <iostream>
+#include <iomanip>
+#include <vector>
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "../src/pson.h"
+#include "../src/util/mmap_allocator.hpp"
+
+using namespace protoson;
+using namespace std;
+
+dynamic_memory_allocator alloc;
+memory_allocator&protoson::pool = alloc;
+
+class vector_writer : public pson_encoder {
+private:
+    vector<uint8_t>& buffer_;
+public:
+    vector_writer(vector<uint8_t>& buffer) : buffer_(buffer){
+    }
+
+protected:
+    virtual bool write(const void *buffer, size_t size) {
+        buffer_.insert(buffer_.end(), (const uint8_t*) buffer, (const uint8_t*) buffer + size);
+        return pson_encoder::write(buffer, size);
+    }
+};
+
+class memory_reader : public pson_decoder {
+private:
+    const uint8_t* buffer_;
+    size_t size_;
+public:
+    memory_reader(const uint8_t *buffer, size_t size) : buffer_(buffer), size_(size){
+    }
+
+protected:
+    virtual bool read(void *buffer, size_t size) {
+        if(read_+size<=size_){
+            memcpy(buffer, &buffer_[read_], size);
+            return pson_decoder::read(buffer, size);
+        }
+        return false;
+    }
+};
+
+// resident memory of this process in MB
+static double resident(){
+    size_t pages = 0;
+    size_t resident_pages = 0;
+    ifstream statm("/proc/self/statm");
+    statm >> pages >> resident_pages;
+    return (double) resident_pages * sysconf(_SC_PAGESIZE) / (1 << 20);
+}
+
+static void run(const char* name, memory_allocator& allocator, const vector<uint8_t>& input){
+    double initial = resident();
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    {
+        pson document;
+        memory_reader reader(input.data(), input.size());
+        reader.set_allocator(&allocator);
+        if(!reader.decode(document)){
+            cerr << "decoding failed" << endl;
+            exit(1);
+        }
+        chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+        cout << setw(10) << name << setw(12) << fixed << setprecision(1) << input.size() / elapsed.count() / (1 << 20)
+             << setw(12) << resident() - initial << setw(12) << setprecision(3) << elapsed.count() << endl;
+    }
+}
+
+// run the benchmark in a child process, so each allocator starts from the same RSS
+static void fork_run(const char* name, const vector<uint8_t>& input){
+    pid_t pid = fork();
+    if(pid==0){
+        string allocator(name);
+        if(allocator=="malloc"){
+            dynamic_memory_allocator dynamic;
+            run(name, dynamic, input);
+        }else{
+            mmap_memory_allocator mmap_allocator(64 << 20, allocator=="hugepages");
+            run(name, mmap_allocator, input);
+        }
+        exit(0);
+    }
+    int status;
+    waitpid(pid, &status, 0);
+}
+
+int main(int argc, char* argv[]) {
+    unsigned long records = argc > 1 ? strtoul(argv[1], NULL, 10) : 500000;
+
+    // a large array of records, like a log or a time series export
+    vector<uint8_t> input;
+    input.reserve(records * 96);
+    {
+        // built on its own mapping, which is returned to the system before running the allocators
+        mmap_memory_allocator generator;
+        pson document;
+        document.set_allocator(generator);
+        pson_array& array = document;
+        for(unsigned long i=0; i<records; i++){
+            pson_object& record = array.add_object();
+            record["id"] = i;
+            record["device"] = "temperature-sensor-0042";
+            record["value"] = 20.5 + (i % 100) / 10.0;
+            ((pson_array&) record["tags"]).add("edge").add("a longer tag value");
+        }
+        vector_writer writer(input);
+        writer.encode(document);
+    }
+
+    cout << records << " records, " << input.size() / (1 << 20) << " MB" << endl;
+    cout << setw(10) << "allocator" << setw(12) << "MB/s" << setw(12) << "RSS MB" << setw(12) << "seconds" << endl;
+    cout.flush();
+    fork_run("malloc", input);
+    fork_run("mmap", input);
+    fork_run("hugepages", input);
+    return 0;
+}
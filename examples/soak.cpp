@@ -0,0 +1,125 @@
+// The MIT License (MIT)
+//
+// Copyright (c) 2017 THINK BIG LABS S.L.
+// Author: alvarolb@gmail.com (Alvaro Luis Bustamante)
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+// Soak test: mutate a state document millions of times, switching the type of its values, and
+// check the memory held by the document stays flat.
+
+#include <iostream>
+#include <cstdlib>
+#include "../src/pson.h"
+
+using namespace protoson;
+using namespace std;
+
+// dynamic allocator that keeps track of the live allocations and bytes
+class tracking_memory_allocator : public memory_allocator {
+public:
+    size_t allocations;
+    size_t bytes;
+
+    tracking_memory_allocator() : allocations(0), bytes(0) {
+    }
+
+    virtual void *allocate(size_t size) {
+        size_t* block = (size_t*) malloc(sizeof(size_t) + size);
+        if(block==NULL) return NULL;
+        *block = size;
+        allocations++;
+        bytes += size;
+        return block + 1;
+    }
+
+    virtual void deallocate(void *ptr) {
+        if(ptr==NULL) return;
+        size_t* block = (size_t*) ptr - 1;
+        allocations--;
+        bytes -= *block;
+        free(block);
+    }
+};
+
+tracking_memory_allocator alloc;
+memory_allocator&protoson::pool = alloc;
+
+static void mutate(pson& state, unsigned long i){
+    static const uint8_t data[] = {1, 2, 3, 4, 5, 6, 7, 8, 9, 10};
+    pson& value = state["value"];
+    switch(i % 8){
+        case 0:
+            value = (int) i;
+            break;
+        case 1:
+            value = "a string value long enough to be allocated";
+            break;
+        case 2:
+            value["nested"]["counter"] = (int) i;
+            break;
+        case 3:
+            ((pson_array&)value).add(i).add("item").add(1.5);
+            break;
+        case 4:
+            value.set_bytes(data, sizeof(data));
+            break;
+        case 5:
+            value.set_null();
+            break;
+        case 6:
+            value = 3.14159265359;
+            break;
+        case 7:
+            value = i % 2 == 0;
+            break;
+    }
+    state["counter"] = (int) i;
+    state["status"] = i % 3 ? "online and reporting" : "offline";
+}
+
+int main(int argc, char* argv[]) {
+    unsigned long iterations = argc > 1 ? strtoul(argv[1], NULL, 10) : 2000000;
+    unsigned long report = iterations >= 10 ? iterations / 10 : 1;
+
+    pson state;
+    // a full cycle of transitions before taking the baseline
+    for(unsigned long i=0; i<8; i++){
+        mutate(state, i);
+    }
+    size_t baseline_allocations = alloc.allocations;
+    size_t baseline_bytes = alloc.bytes;
+    cout << "baseline: " << baseline_allocations << " allocations, " << baseline_bytes << " bytes" << endl;
+
+    for(unsigned long i=8; i<iterations; i++){
+        mutate(state, i);
+        if((i+1) % report == 0){
+            cout << i+1 << " mutations: " << alloc.allocations << " allocations, " << alloc.bytes << " bytes" << endl;
+        }
+    }
+
+    // same position of the cycle as the baseline
+    for(unsigned long i=iterations; i % 8 != 0; i++){
+        mutate(state, i);
+    }
+
+    bool flat = alloc.allocations == baseline_allocations && alloc.bytes == baseline_bytes;
+    cout << (flat ? "memory is flat" : "memory grew") << endl;
+    return flat ? 0 : 1;
+}
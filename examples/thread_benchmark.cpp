@@ -0,0 +1,142 @@
+// The MIT License (MIT)
+//
+// Copyright (c) 2017 THINK BIG LABS S.L.
+// Author: alvarolb@gmail.com (Alvaro Luis Bustamante)
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+// Decode workers benchmark: every thread decodes the same message into a new document and discards
+// it, once with malloc/free and once with the thread caching allocator, for an increasing number of
+// threads.
+
+#include <iostream>
+#include <iomanip>
+#include <thread>
+#include <vector>
+#include <chrono>
+#include <cstdlib>
+#include "../src/pson.h"
+#include "../src/util/thread_caching_allocator.hpp"
+
+using namespace protoson;
+using namespace std;
+
+dynamic_memory_allocator alloc;
+memory_allocator&protoson::pool = alloc;
+
+class memory_writer : public pson_encoder {
+private:
+    uint8_t* buffer_;
+    size_t size_;
+public:
+    memory_writer(uint8_t *buffer, size_t size) : buffer_(buffer), size_(size){
+    }
+
+protected:
+    virtual bool write(const void *buffer, size_t size) {
+        if(written_+size<=size_){
+            memcpy(&buffer_[written_], buffer, size);
+            return pson_encoder::write(buffer, size);
+        }
+        return false;
+    }
+};
+
+class memory_reader : public pson_decoder {
+private:
+    const uint8_t* buffer_;
+    size_t size_;
+public:
+    memory_reader(const uint8_t *buffer, size_t size) : buffer_(buffer), size_(size){
+    }
+
+protected:
+    virtual bool read(void *buffer, size_t size) {
+        if(read_+size<=size_){
+            memcpy(buffer, &buffer_[read_], size);
+            return pson_decoder::read(buffer, size);
+        }
+        return false;
+    }
+};
+
+static void worker(memory_allocator& allocator, const uint8_t* message, size_t size, unsigned long iterations){
+    for(unsigned long i=0; i<iterations; i++){
+        pson document;
+        document.set_allocator(allocator);
+        memory_reader reader(message, size);
+        reader.set_allocator(&allocator);
+        if(!reader.decode(document)){
+            cerr << "decoding failed" << endl;
+            exit(1);
+        }
+    }
+}
+
+// decoded documents per second with the given number of threads
+static double run(memory_allocator& allocator, const uint8_t* message, size_t size, unsigned threads, unsigned long iterations){
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    vector<thread> workers;
+    for(unsigned i=0; i<threads; i++){
+        workers.push_back(thread(worker, ref(allocator), message, size, iterations));
+    }
+    for(size_t i=0; i<workers.size(); i++){
+        workers[i].join();
+    }
+    chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+    return threads * iterations / elapsed.count();
+}
+
+int main(int argc, char* argv[]) {
+    unsigned long iterations = argc > 1 ? strtoul(argv[1], NULL, 10) : 20000;
+    unsigned max_threads = thread::hardware_concurrency();
+    if(max_threads==0) max_threads = 4;
+
+    // a typical device message
+    pson message;
+    message["device"] = "temperature-sensor-0042";
+    message["timestamp"] = 1760781600;
+    message["online"] = true;
+    pson_array& readings = message["readings"];
+    for(int i=0; i<16; i++){
+        pson_object& reading = readings.add_object();
+        reading["sensor"] = "a sensor name long enough to allocate";
+        reading["value"] = 20.5 + i;
+        reading["unit"] = "celsius";
+    }
+    pson_object& location = message["location"];
+    location["latitude"] = 40.4168;
+    location["longitude"] = -3.7038;
+
+    uint8_t buffer[4096];
+    memory_writer writer(buffer, sizeof(buffer));
+    writer.encode(message);
+
+    dynamic_memory_allocator dynamic;
+    thread_caching_memory_allocator caching;
+
+    cout << setw(8) << "threads" << setw(16) << "malloc/s" << setw(16) << "caching/s" << setw(10) << "speedup" << endl;
+    for(unsigned threads=1; threads<=max_threads; threads*=2){
+        double dynamic_rate = run(dynamic, buffer, writer.bytes_written(), threads, iterations);
+        double caching_rate = run(caching, buffer, writer.bytes_written(), threads, iterations);
+        cout << setw(8) << threads << setw(16) << (unsigned long) dynamic_rate << setw(16) << (unsigned long) caching_rate
+             << setw(9) << fixed << setprecision(2) << caching_rate / dynamic_rate << "x" << endl;
+    }
+    return 0;
+}
@@ -0,0 +1,192 @@
+// The MIT License (MIT)
+//
+// Copyright (c) 2017 THINK BIG LABS S.L.
+// Author: alvarolb@gmail.com (Alvaro Luis Bustamante)
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+// Event walking benchmark: reads a large contiguous pson document by decoding it into a tree, and by
+// walking it with a pson_handler that aggregates its values, compared with copying the same bytes.
+
+#include <iostream>
+#include <iomanip>
+#include <vector>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include "../src/pson.h"
+
+using namespace protoson;
+using namespace std;
+
+dynamic_memory_allocator alloc;
+memory_allocator&protoson::pool = alloc;
+
+class vector_writer : public pson_encoder {
+private:
+    vector<uint8_t>& buffer_;
+public:
+    vector_writer(vector<uint8_t>& buffer) : buffer_(buffer){
+    }
+
+protected:
+    virtual bool write(const void *buffer, size_t size) {
+        buffer_.insert(buffer_.end(), (const uint8_t*) buffer, (const uint8_t*) buffer + size);
+        return pson_encoder::write(buffer, size);
+    }
+};
+
+class memory_reader : public pson_decoder {
+private:
+    const uint8_t* buffer_;
+    size_t size_;
+public:
+    memory_reader(const uint8_t *buffer, size_t size) : buffer_(buffer), size_(size){
+    }
+
+protected:
+    virtual bool read(void *buffer, size_t size) {
+        if(read_+size<=size_){
+            memcpy(buffer, &buffer_[read_], size);
+            return pson_decoder::read(buffer, size);
+        }
+        return false;
+    }
+
+    virtual const void* read_reference(size_t size) {
+        if(read_+size<=size_){
+            const void* reference = &buffer_[read_];
+            read_ += size;
+            return reference;
+        }
+        return NULL;
+    }
+};
+
+// hands the whole buffer to the decoder, which then reads it without virtual calls
+class input_reader : public pson_decoder {
+public:
+    input_reader(const uint8_t *buffer, size_t size){
+        set_input(buffer, size);
+    }
+};
+
+// sums the numbers and string lengths of a document, without building it
+class aggregator : public pson_handler {
+public:
+    double sum;
+    size_t characters;
+    size_t values;
+
+    aggregator() : sum(0), characters(0), values(0) {
+    }
+
+    virtual bool integer(uint64_t magnitude, bool negative){
+        sum += negative ? -(double) magnitude : (double) magnitude;
+        values++;
+        return true;
+    }
+
+    virtual bool real(double value){
+        sum += value;
+        values++;
+        return true;
+    }
+
+    virtual bool string(const char*, size_t size){
+        characters += size;
+        values++;
+        return true;
+    }
+};
+
+template<class F>
+static void measure(const char* name, size_t bytes, F function){
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    function();
+    chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+    cout << setw(10) << name << setw(12) << fixed << setprecision(1) << bytes / elapsed.count() / (1 << 20)
+         << setw(12) << setprecision(3) << elapsed.count() << endl;
+}
+
+int main(int argc, char* argv[]) {
+    unsigned long records = argc > 1 ? strtoul(argv[1], NULL, 10) : 500000;
+
+    // a large array of records, like a log or a time series export
+    vector<uint8_t> input;
+    {
+        pson document;
+        pson_array& array = document;
+        for(unsigned long i=0; i<records; i++){
+            pson_object& record = array.add_object();
+            record["id"] = i;
+            record["device"] = "temperature-sensor-0042";
+            record["value"] = 20.5 + (i % 100) / 10.0;
+            ((pson_array&) record["tags"]).add("edge").add("a longer tag value");
+        }
+        vector_writer writer(input);
+        writer.encode(document);
+    }
+
+    cout << records << " records, " << input.size() / (1 << 20) << " MB" << endl;
+    cout << setw(10) << "reader" << setw(12) << "MB/s" << setw(12) << "seconds" << endl;
+
+    vector<uint8_t> copy(input.size());
+    measure("memcpy", input.size(), [&]{
+        memcpy(copy.data(), input.data(), input.size());
+    });
+
+    measure("decode", input.size(), [&]{
+        pson document;
+        memory_reader reader(input.data(), input.size());
+        if(!reader.decode(document)){
+            cerr << "decoding failed" << endl;
+            exit(1);
+        }
+    });
+
+    measure("decode*", input.size(), [&]{
+        pson document;
+        input_reader reader(input.data(), input.size());
+        if(!reader.decode(document)){
+            cerr << "decoding failed" << endl;
+            exit(1);
+        }
+    });
+
+    aggregator handler;
+    measure("walk", input.size(), [&]{
+        memory_reader reader(input.data(), input.size());
+        if(!reader.walk(handler)){
+            cerr << "walking failed" << endl;
+            exit(1);
+        }
+    });
+
+    measure("walk*", input.size(), [&]{
+        input_reader reader(input.data(), input.size());
+        if(!reader.walk(handler)){
+            cerr << "walking failed" << endl;
+            exit(1);
+        }
+    });
+    cout << "* reading the input directly (see pson_decoder::set_input)" << endl;
+    cout << handler.values << " values, " << handler.characters << " characters" << endl;
+    return 0;
+}
@@ -29,16 +29,36 @@
 #include <math.h>
 #include <stdlib.h>
 
+#include <stddef.h>
+
 #ifdef ARDUINO
 #include <Arduino.h>
 #else
 #include <string>
+#include <iterator>
+#if __cplusplus >= 201703L
+#include <string_view>
+#endif
 #endif
 
 #ifndef UINT32_MAX
 #define UINT32_MAX  4294967295U
 #endif
 
+// initial number of items reserved by an object or array when its first item is created
+#ifndef PSON_CONTAINER_CAPACITY
+#define PSON_CONTAINER_CAPACITY 4
+#endif
+
+// number of allocators that can exist at the same time, including the global pool
+#ifndef PSON_MAX_ALLOCATORS
+#ifdef ARDUINO
+#define PSON_MAX_ALLOCATORS 8
+#else
+#define PSON_MAX_ALLOCATORS 256
+#endif
+#endif
+
 /*
  * Dummy placement new operator to support old Arduino compilers where this operator is not defined
  * (and cannot be used from inside a class), and also to not overwrite global operator from modern
@@ -48,13 +68,85 @@ inline void * operator new(size_t sz, void * here, void* dummy) { return here; }
 
 namespace protoson {
 
+    /*
+     * Allocators register in a table of PSON_MAX_ALLOCATORS entries when they are constructed, so pson
+     * values refer to their allocator by a small index instead of a pointer. Index 0 is the global
+     * pool. Slots are claimed and cleared atomically, so allocators can be created and destroyed from
+     * any thread. When the table is full the allocator stays unregistered: set_allocator returns false
+     * and values or containers constructed with it fall back to the pool.
+     */
     class memory_allocator{
+    private:
+        enum { unregistered = 0xFFFF };
+
+        uint16_t index_;
+
+        static memory_allocator** allocators(){
+            static memory_allocator* table[PSON_MAX_ALLOCATORS];
+            return table;
+        }
+
+        static uint16_t add_allocator(memory_allocator* allocator){
+            memory_allocator** table = allocators();
+            for(uint16_t i=1; i<PSON_MAX_ALLOCATORS && i<unregistered; i++){
+                memory_allocator* expected = NULL;
+                if(__atomic_compare_exchange_n(&table[i], &expected, allocator, false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)){
+                    return i;
+                }
+            }
+            return unregistered;
+        }
+
     public:
+        // blocks handed out by allocators are aligned for any value stored in a tree
+        enum { alignment = sizeof(double) > sizeof(void*) ? sizeof(double) : sizeof(void*) };
+
+        // size rounded up to a multiple of the alignment
+        static constexpr size_t align(size_t size){
+            return (size + alignment - 1) & ~(size_t)(alignment - 1);
+        }
+
+        memory_allocator() : index_(add_allocator(this)) {
+        }
+
+        memory_allocator(const memory_allocator&) : index_(add_allocator(this)) {
+        }
+
+        memory_allocator& operator=(const memory_allocator&){
+            return *this;
+        }
+
+        virtual ~memory_allocator(){
+            if(index_!=unregistered){
+                __atomic_store_n(&allocators()[index_], (memory_allocator*) NULL, __ATOMIC_RELEASE);
+            }
+        }
+
+        // false when the table was full, so values cannot be bound to this allocator
+        bool registered() const;
+
+        // index stored by values using this allocator, which is the pool one if it is not registered
+        uint16_t index() const;
+
+        static memory_allocator& at(uint16_t index);
 
         // allocate
         virtual void *allocate(size_t size) = 0;
         virtual void deallocate(void *) = 0;
 
+        // deallocate a block of a known size, so allocators with size classes can skip looking it up
+        virtual void deallocate(void * ptr, size_t){
+            deallocate(ptr);
+        }
+
+        /*
+         * Allocators whose deallocate() does nothing (memory is reclaimed in bulk) return true, so
+         * containers are discarded without walking and destroying their items one by one.
+         */
+        virtual bool trivial_deallocate() const{
+            return false;
+        }
+
         template <class T>
         T* allocate(){
             /*
@@ -67,15 +159,32 @@ namespace protoson {
             return NULL;
         }
 
+        // allocate and construct an object that takes a single constructor argument
+        template <class T, class A>
+        T* allocate(A& argument){
+            if(void * memory = allocate(sizeof(T))){
+                return new (memory, NULL) T(argument);
+            }
+            return NULL;
+        }
+
         template <class T>
         void destroy(T* p){
             if(p){
                 p->~T();
-                deallocate(p);
+                deallocate(p, sizeof(T));
             }
         }
     };
 
+    /*
+     * Allocators are not synchronized, except dynamic_memory_allocator (as thread safe as malloc).
+     * Encoders and decoders only allocate through the values they decode into, so threads can work
+     * concurrently on different trees as long as their allocators are thread safe or not shared. See
+     * util/thread_caching_allocator.hpp for a pool suited to multi-threaded programs.
+     */
+
+    // bump allocator that wraps around its buffer, for trees that are discarded before it is reused
     template<size_t buffer_size>
     class circular_memory_allocator : public memory_allocator{
     private:
@@ -98,6 +207,101 @@ namespace protoson {
         }
 
         virtual void deallocate(void *) {}
+
+        virtual bool trivial_deallocate() const{
+            return true;
+        }
+    };
+
+    /*
+     * Ring allocator for streaming pipelines with a fixed memory budget. Allocations are bumped from a
+     * static buffer and grouped in messages, which are released in the order they were started, so a
+     * message can be decoded while previous ones are still in use. Unlike circular_memory_allocator, it
+     * never wraps over live messages: an allocation that does not fit in the free space fails (so the
+     * decoder returns false). Every message gets a generation number, and releasing any message but
+     * the oldest is refused.
+     */
+    template<size_t buffer_size, size_t max_messages=4>
+    class ring_memory_allocator : public memory_allocator{
+    private:
+        union {
+            uint8_t bytes[buffer_size];
+            double real;
+            void* pointer;
+        } buffer_;
+        // bytes held by each live message, including the end of the buffer skipped when wrapping
+        size_t messages_[max_messages];
+        uint32_t generations_[max_messages];
+        // live data is the used_ bytes before head_, so the oldest live byte is at the tail
+        size_t head_;
+        size_t used_;
+        size_t first_;
+        size_t count_;
+        uint32_t generation_;
+
+    public:
+        ring_memory_allocator() : head_(0), used_(0), first_(0), count_(0), generation_(0) {
+        }
+
+        /*
+         * Start a new message, which holds all the following allocations. Returns its generation, or 0
+         * if max_messages are already live.
+         */
+        uint32_t begin_message(){
+            if(count_==max_messages) return 0;
+            if(++generation_==0) generation_ = 1;
+            size_t index = (first_ + count_++) % max_messages;
+            messages_[index] = 0;
+            generations_[index] = generation_;
+            return generation_;
+        }
+
+        // release the oldest live message, which must have the given generation
+        bool release_message(uint32_t generation){
+            if(count_==0 || generation!=generations_[first_]) return false;
+            used_ -= messages_[first_];
+            first_ = (first_ + 1) % max_messages;
+            count_--;
+            if(used_==0){
+                head_ = 0;
+            }
+            return true;
+        }
+
+        virtual void *allocate(size_t size) {
+            if(count_==0 && begin_message()==0) return NULL;
+            size = align(size);
+            size_t tail = (head_ + buffer_size - used_) % buffer_size;
+            size_t position = head_;
+            size_t skipped = 0;
+            if(used_>0 && head_<=tail){
+                // wrapped around (or full): the free space is between the head and the tail
+                if(size > tail - head_) return NULL;
+            }else if(size > buffer_size - head_){
+                // not enough room at the end, continue from the beginning of the buffer
+                if(size > tail) return NULL;
+                skipped = buffer_size - head_;
+                position = 0;
+            }
+            messages_[(first_ + count_ - 1) % max_messages] += skipped + size;
+            used_ += skipped + size;
+            head_ = position + size;
+            return &buffer_.bytes[position];
+        }
+
+        virtual void deallocate(void *) {}
+
+        virtual bool trivial_deallocate() const{
+            return true;
+        }
+
+        size_t used() const{
+            return used_;
+        }
+
+        size_t live_messages() const{
+            return count_;
+        }
     };
 
     class dynamic_memory_allocator : public memory_allocator{
@@ -111,638 +315,2100 @@ namespace protoson {
         }
     };
 
-    extern memory_allocator& pool;
-}
+    /*
+     * Monotonic allocator that serves allocations from large blocks taken from malloc. Memory is not
+     * released by deallocate(), but all at once by reset(), which keeps the current block for reuse, so
+     * a document can be built and discarded per message without calling malloc or free.
+     */
+    class arena_memory_allocator : public memory_allocator{
+    private:
+        struct block{
+            block* next;
+            size_t size;
+        };
 
-namespace protoson {
+        enum {
+            header_size = align(sizeof(block))
+        };
 
-    enum pb_wire_type{
-        varint = 0,
-        fixed_64 = 1,
-        length_delimited = 2,
-        fixed_32 = 5,
-        pson_type = 6
-    };
+        block* blocks_;
+        size_t block_size_;
+        size_t index_;
 
-    template<class T>
-    class pson_container {
+        bool add_block(size_t size){
+            block* new_block = (block*) malloc(header_size + size);
+            if(new_block==NULL) return false;
+            new_block->next = blocks_;
+            new_block->size = size;
+            blocks_ = new_block;
+            index_ = 0;
+            return true;
+        }
 
-    protected:
-        class list_item{
-        public:
-            list_item() : next_(NULL), previous_(NULL) {}
-            ~list_item(){}
+    public:
+        explicit arena_memory_allocator(size_t block_size=1024) : blocks_(NULL), block_size_(block_size), index_(0) {
+        }
 
-            T item_;
-            list_item* next_;
-            list_item* previous_;
-        };
+        arena_memory_allocator(const arena_memory_allocator&) = delete;
+        arena_memory_allocator& operator=(const arena_memory_allocator&) = delete;
 
-    public:
+        ~arena_memory_allocator(){
+            release();
+        }
 
-        class iterator{
-        public:
-            iterator(list_item *item) : current_(item) {
+        virtual void *allocate(size_t size) {
+            size = align(size);
+            if(blocks_==NULL || index_ + size > blocks_->size){
+                if(!add_block(size > block_size_ ? size : block_size_)) return NULL;
             }
+            void* position = (uint8_t*) blocks_ + header_size + index_;
+            index_ += size;
+            return position;
+        }
 
-        private:
-            list_item * current_;
+        virtual void deallocate(void *) {}
 
-        public:
+        virtual bool trivial_deallocate() const{
+            return true;
+        }
 
-            bool next(){
-                if(current_==NULL) return false;
-                current_ = current_->next_;
-                return true;
+        // discard every allocation, keeping the current block
+        void reset(){
+            if(blocks_==NULL) return;
+            block* current = blocks_->next;
+            while(current!=NULL){
+                block* next = current->next;
+                free(current);
+                current = next;
             }
+            blocks_->next = NULL;
+            index_ = 0;
+        }
 
-            bool has_next(){
-                return current_!=NULL && current_->next_!=NULL;
-            }
+        // discard every allocation and return all the blocks
+        void release(){
+            reset();
+            free(blocks_);
+            blocks_ = NULL;
+        }
 
-            bool valid(){
-                return current_!=NULL;
+        // bytes handed out, including alignment and the unused tail of previous blocks
+        size_t used() const{
+            size_t used = index_;
+            for(block* current = blocks_ ? blocks_->next : NULL; current!=NULL; current=current->next){
+                used += current->size;
             }
+            return used;
+        }
 
-            T& item(){
-                return current_->item_;
+        // bytes held in blocks taken from malloc
+        size_t capacity() const{
+            size_t capacity = 0;
+            for(block* current = blocks_; current!=NULL; current=current->next){
+                capacity += current->size;
             }
-        };
+            return capacity;
+        }
+    };
 
-    protected:
-        list_item* item_;
-        list_item* last_;
+    /*
+     * Fixed arena stored inline (on the stack or inside another object), so small documents are
+     * decoded without touching the heap. Allocations are bumped from the buffer and, once it is full,
+     * served by the fallback allocator. Freeing the last inline allocation gives its space back;
+     * the rest of the buffer is reclaimed all at once by reset().
+     */
+    template<size_t buffer_size>
+    class inline_arena_memory_allocator : public memory_allocator{
+    private:
+        union {
+            uint8_t bytes[buffer_size];
+            double real;
+            void* pointer;
+        } buffer_;
+        size_t index_;
+        memory_allocator& fallback_;
+        size_t spilled_;
 
-    public:
-        iterator begin() const{
-            return iterator(item_);
+        bool owns(void* ptr) const{
+            return ptr >= (const void*) buffer_.bytes && ptr < (const void*) (buffer_.bytes + buffer_size);
         }
 
-        iterator end() const{
-            return iterator(last_);
+    public:
+        explicit inline_arena_memory_allocator(memory_allocator& fallback) : index_(0), fallback_(fallback), spilled_(0) {
         }
 
-        pson_container() : item_(NULL), last_(NULL) {
-        }
+        inline_arena_memory_allocator(const inline_arena_memory_allocator&) = delete;
+        inline_arena_memory_allocator& operator=(const inline_arena_memory_allocator&) = delete;
 
-        ~pson_container(){
-            clear();
+        virtual void *allocate(size_t size) {
+            size_t aligned = align(size);
+            if(aligned <= buffer_size - index_){
+                void* position = &buffer_.bytes[index_];
+                index_ += aligned;
+                return position;
+            }
+            void* memory = fallback_.allocate(size);
+            if(memory!=NULL) spilled_++;
+            return memory;
         }
 
-        size_t size() const{
-            size_t size = 0;
-            list_item* current = item_;
-            while(current!=NULL){
-                current = current->next_;
-                size++;
-            }
-            return size;
+        virtual void deallocate(void * ptr) {
+            if(ptr==NULL || owns(ptr)) return;
+            spilled_--;
+            fallback_.deallocate(ptr);
         }
 
-        T* operator[](size_t index){
-            list_item* current = item_;
-            size_t current_index = 0;
-            while(current!=NULL){
-                if(current_index==index){
-                    return &current->item_;
+        virtual void deallocate(void * ptr, size_t size) {
+            if(ptr==NULL) return;
+            if(owns(ptr)){
+                size_t aligned = align(size);
+                if((uint8_t*) ptr + aligned == &buffer_.bytes[index_]){
+                    index_ -= aligned;
                 }
-                current = current->next_;
-                current_index++;
+                return;
             }
-            return NULL;
+            spilled_--;
+            fallback_.deallocate(ptr, size);
         }
 
-        void clear(){
-            while(last_!=NULL){
-                list_item* previous = last_->previous_;
-                pool.destroy(last_);
-                last_ = previous;
-            }
+        // items can be skipped on clear while nothing live comes from a fallback that needs freeing
+        virtual bool trivial_deallocate() const{
+            return spilled_==0 || fallback_.trivial_deallocate();
         }
 
-        T* create_item(){
-            list_item* new_list_item = pool.allocate<list_item>();
-            if(new_list_item==NULL) return NULL;
-            if(item_==NULL){
-                item_ = new_list_item;
-            }else{
-                last_->next_ = new_list_item;
-                new_list_item->previous_ = last_;
-            }
-            last_ = new_list_item;
-            return &(new_list_item->item_);
+        // discard every inline allocation (blocks taken from the fallback must be freed before)
+        void reset(){
+            index_ = 0;
+        }
+
+        // bytes of the buffer in use
+        size_t used() const{
+            return index_;
+        }
+
+        // live allocations served by the fallback allocator
+        size_t spilled() const{
+            return spilled_;
         }
     };
 
-    class pson_object;
-    class pson_array;
+    /*
+     * Pool allocator for the small and regular blocks used by pson trees (nodes, pairs, containers,
+     * item storage, names and short payloads). Blocks are rounded to a multiple of the alignment and
+     * served from per size class free lists, so allocations and sized deallocations are O(1). New
+     * blocks are carved in allocation order from slabs taken from malloc, keeping the blocks of a
+     * document close together. Blocks larger than max_block_size go straight to malloc and free.
+     * Slabs are only returned to the system when the allocator is destroyed.
+     */
+    class slab_memory_allocator : public memory_allocator{
+    private:
+        enum {
+            max_block_size = 256,
+            size_classes = max_block_size / alignment
+        };
 
-    class pson {
-    public:
-        enum field_type {
-            null_field      = 0,
-            varint_field    = 1,
-            svarint_field   = 2,
-            float_field     = 3,
-            double_field    = 4,
-            true_field      = 5,
-            false_field     = 6,
-            zero_field      = 7,
-            one_field       = 8,
-            string_field    = 9,
-            empty_string    = 10,
-            bytes_field     = 11,
-            empty_bytes     = 12,
-            object_field    = 13,
-            array_field     = 14,
-            empty           = 15
-            // a message tag is encoded in a 128-base varint [1-bit][3-bit wire type][4-bit field]
-            // we have up to 4 bits (0-15) for encoding fields in the first byte
+        struct free_block{
+            free_block* next;
         };
 
-        // interchange two different containers
-        static void swap(pson& source, pson& destination){
-            // destroy destination container data (if any)
-            destination.~pson();
-            // override fields
-            destination.value_ = source.value_;
-            destination.field_type_ = source.field_type_;
-            // 'clear' source container
-            source.value_ = NULL;
-            source.field_type_ = empty;
-        }
+        struct slab{
+            slab* next;
+            size_t size;
+        };
 
-        bool is_boolean() const{
-            return field_type_ == true_field || field_type_ == false_field;
-        }
+        enum {
+            header_size = align(sizeof(slab))
+        };
 
-        bool is_string() const{
-            return field_type_ == string_field;
+        free_block* free_[size_classes];
+        slab* slabs_;
+        size_t slab_size_;
+        size_t index_;
+
+        bool owns(void* ptr) const{
+            for(slab* current = slabs_; current!=NULL; current=current->next){
+                uint8_t* start = (uint8_t*) current + header_size;
+                if(ptr>=start && ptr<start + current->size) return true;
+            }
+            return false;
         }
 
-        bool is_bytes() const{
-            return field_type_ == bytes_field;
+    public:
+        explicit slab_memory_allocator(size_t slab_size=4096) : slabs_(NULL), slab_size_(slab_size < (size_t) max_block_size ? (size_t) max_block_size : slab_size), index_(0) {
+            for(size_t i=0; i<size_classes; i++){
+                free_[i] = NULL;
+            }
         }
 
-        bool is_number() const{
-            return  field_type_ == varint_field     ||
-                    field_type_ == svarint_field    ||
-                    field_type_ == float_field      ||
-                    field_type_ == double_field     ||
-                    field_type_ == zero_field       ||
-                    field_type_ == one_field;
+        slab_memory_allocator(const slab_memory_allocator&) = delete;
+        slab_memory_allocator& operator=(const slab_memory_allocator&) = delete;
+
+        ~slab_memory_allocator(){
+            while(slabs_!=NULL){
+                slab* next = slabs_->next;
+                free(slabs_);
+                slabs_ = next;
+            }
         }
 
-        bool is_float() const{
-            return  field_type_ == float_field      ||
-                    field_type_ == double_field;
+        virtual void *allocate(size_t size) {
+            if(size>max_block_size){
+                return malloc(size);
+            }
+            size_t size_class = size>0 ? (size - 1) / alignment : 0;
+            if(free_block* block = free_[size_class]){
+                free_[size_class] = block->next;
+                return block;
+            }
+            size = (size_class + 1) * alignment;
+            if(slabs_==NULL || index_ + size > slabs_->size){
+                slab* new_slab = (slab*) malloc(header_size + slab_size_);
+                if(new_slab==NULL) return NULL;
+                new_slab->next = slabs_;
+                new_slab->size = slab_size_;
+                slabs_ = new_slab;
+                index_ = 0;
+            }
+            void* position = (uint8_t*) slabs_ + header_size + index_;
+            index_ += size;
+            return position;
         }
 
-        bool is_integer() const{
-            return  field_type_ == varint_field     ||
-                    field_type_ == svarint_field    ||
-                    field_type_ == zero_field       ||
-                    field_type_ == one_field;
+        virtual void deallocate(void * ptr, size_t size) {
+            if(ptr==NULL) return;
+            if(size>max_block_size){
+                free(ptr);
+                return;
+            }
+            size_t size_class = size>0 ? (size - 1) / alignment : 0;
+            free_block* block = (free_block*) ptr;
+            block->next = free_[size_class];
+            free_[size_class] = block;
         }
 
-        bool is_object() const{
-            return field_type_ == object_field;
+        // without the size, blocks from the slabs cannot be reused until the allocator is destroyed
+        virtual void deallocate(void * ptr) {
+            if(ptr!=NULL && !owns(ptr)){
+                free(ptr);
+            }
         }
 
-        bool is_array() const{
-            return field_type_ == array_field;
+        // bytes held in slabs taken from malloc
+        size_t capacity() const{
+            size_t capacity = 0;
+            for(slab* current = slabs_; current!=NULL; current=current->next){
+                capacity += current->size;
+            }
+            return capacity;
         }
+    };
 
-        bool is_null() const{
-            return field_type_ == null_field;
+    /*
+     * Wrapper that records the activity of another allocator: allocation and deallocation counts,
+     * failed allocations, live and peak bytes, and a histogram of the requested sizes. Bytes are
+     * tracked through the sized deallocations used by the library; blocks released without their size
+     * are counted, but their bytes stay live.
+     */
+    class instrumented_memory_allocator : public memory_allocator{
+    public:
+        // sizes up to 2^(i) bytes are counted in bucket i, larger sizes in the last one
+        enum { histogram_size = 16 };
+
+        struct statistics{
+            size_t allocations;
+            size_t deallocations;
+            size_t failed_allocations;
+            size_t allocated_bytes;
+            size_t live_bytes;
+            size_t peak_bytes;
+            size_t histogram[histogram_size];
+        };
+
+    private:
+        memory_allocator& allocator_;
+        statistics stats_;
+
+    public:
+        explicit instrumented_memory_allocator(memory_allocator& allocator) : allocator_(allocator){
+            memset(&stats_, 0, sizeof(stats_));
         }
 
-        bool is_empty() const{
-            return field_type_ == empty;
+        virtual void *allocate(size_t size) {
+            void* ptr = allocator_.allocate(size);
+            if(ptr==NULL){
+                stats_.failed_allocations++;
+                return NULL;
+            }
+            size_t bucket = 0;
+            while(bucket<histogram_size-1 && ((size_t)1 << bucket) < size){
+                bucket++;
+            }
+            stats_.histogram[bucket]++;
+            stats_.allocations++;
+            stats_.allocated_bytes += size;
+            stats_.live_bytes += size;
+            if(stats_.live_bytes>stats_.peak_bytes){
+                stats_.peak_bytes = stats_.live_bytes;
+            }
+            return ptr;
         }
 
-        pson() : value_(NULL), field_type_(empty) {
+        virtual void deallocate(void * ptr) {
+            if(ptr==NULL) return;
+            stats_.deallocations++;
+            allocator_.deallocate(ptr);
         }
 
-        template<class T>
-        pson(T value) : value_(NULL), field_type_(empty){
-            *this = value;
+        virtual void deallocate(void * ptr, size_t size) {
+            if(ptr==NULL) return;
+            stats_.deallocations++;
+            stats_.live_bytes -= size < stats_.live_bytes ? size : stats_.live_bytes;
+            allocator_.deallocate(ptr, size);
         }
 
-        ~pson(){
-            if(field_type_==object_field){
-                pool.destroy((pson_object *) value_);
-            }else if(field_type_==array_field) {
-                pool.destroy((pson_array *) value_);
-            }else{
-                pool.deallocate(value_);
-            }
-            value_ = NULL;
-            field_type_ = empty;
+        virtual bool trivial_deallocate() const{
+            return allocator_.trivial_deallocate();
         }
 
-        template<class T>
-        void operator=(T value)
-        {
-            if(value==0){
-                field_type_ = zero_field;
-            }else if(value==1) {
-                field_type_ = one_field;
-            }else{
-                uint64_t uint_value = value>0 ? value : -value;
-                if(allocate(pson::get_varint_size(uint_value))){
-                    pb_encode_varint(uint_value);
-                    field_type_ = value>0 ? varint_field : svarint_field;
-                }
-            }
+        const statistics& stats() const{
+            return stats_;
         }
 
-        void operator=(bool value){
-            field_type_ = value ? true_field : false_field;
+        // start a new measurement (i.e., per document), keeping the bytes that are still live
+        void reset(){
+            size_t live_bytes = stats_.live_bytes;
+            memset(&stats_, 0, sizeof(stats_));
+            stats_.live_bytes = live_bytes;
+            stats_.peak_bytes = live_bytes;
         }
+    };
 
-        void operator=(float value) {
+    extern memory_allocator& pool;
+
+    inline bool memory_allocator::registered() const{
+        return index_!=unregistered || this==&pool;
+    }
+
+    inline uint16_t memory_allocator::index() const{
+        return this==&pool || index_==unregistered ? 0 : index_;
+    }
+
+    inline memory_allocator& memory_allocator::at(uint16_t index){
+        return index==0 ? pool : *__atomic_load_n(&allocators()[index], __ATOMIC_ACQUIRE);
+    }
+}
+
+namespace protoson {
+
+    enum pb_wire_type{
+        varint = 0,
+        fixed_64 = 1,
+        length_delimited = 2,
+        fixed_32 = 5,
+        pson_type = 6
+    };
+
+    /*
+     * Items are allocated one by one and indexed by a contiguous array of pointers, so iterators are
+     * random access, and references to items stay valid while the container grows.
+     */
+    template<class T>
+    class pson_container {
+
+    public:
+
+        template<class V>
+        class basic_iterator{
+        public:
+#ifndef ARDUINO
+            typedef std::random_access_iterator_tag iterator_category;
+#endif
+            typedef T value_type;
+            typedef ptrdiff_t difference_type;
+            typedef V* pointer;
+            typedef V& reference;
+
+            basic_iterator() : current_(NULL), end_(NULL) {
+            }
+
+            basic_iterator(T* const* item, T* const* end) : current_(item), end_(end) {
+            }
+
+            template<class U>
+            basic_iterator(const basic_iterator<U>& other) : current_(other.current_), end_(other.end_) {
+            }
+
+        private:
+            template<class U> friend class basic_iterator;
+            T* const* current_;
+            T* const* end_;
+
+        public:
+
+            bool next(){
+                if(current_==end_) return false;
+                ++current_;
+                return true;
+            }
+
+            bool has_next(){
+                return current_!=end_ && current_+1!=end_;
+            }
+
+            bool valid(){
+                return current_!=end_;
+            }
+
+            V& item(){
+                return **current_;
+            }
+
+            V& operator*() const{
+                return **current_;
+            }
+
+            V* operator->() const{
+                return *current_;
+            }
+
+            V& operator[](difference_type n) const{
+                return *current_[n];
+            }
+
+            basic_iterator& operator++(){
+                ++current_;
+                return *this;
+            }
+
+            basic_iterator operator++(int){
+                basic_iterator it = *this;
+                ++current_;
+                return it;
+            }
+
+            basic_iterator& operator--(){
+                --current_;
+                return *this;
+            }
+
+            basic_iterator operator--(int){
+                basic_iterator it = *this;
+                --current_;
+                return it;
+            }
+
+            basic_iterator& operator+=(difference_type n){
+                current_ += n;
+                return *this;
+            }
+
+            basic_iterator& operator-=(difference_type n){
+                current_ -= n;
+                return *this;
+            }
+
+            basic_iterator operator+(difference_type n) const{
+                return basic_iterator(current_ + n, end_);
+            }
+
+            friend basic_iterator operator+(difference_type n, const basic_iterator& it){
+                return it + n;
+            }
+
+            basic_iterator operator-(difference_type n) const{
+                return basic_iterator(current_ - n, end_);
+            }
+
+            difference_type operator-(const basic_iterator& other) const{
+                return current_ - other.current_;
+            }
+
+            bool operator==(const basic_iterator& other) const{
+                return current_ == other.current_;
+            }
+
+            bool operator!=(const basic_iterator& other) const{
+                return current_ != other.current_;
+            }
+
+            bool operator<(const basic_iterator& other) const{
+                return current_ < other.current_;
+            }
+
+            bool operator>(const basic_iterator& other) const{
+                return current_ > other.current_;
+            }
+
+            bool operator<=(const basic_iterator& other) const{
+                return current_ <= other.current_;
+            }
+
+            bool operator>=(const basic_iterator& other) const{
+                return current_ >= other.current_;
+            }
+        };
+
+        typedef basic_iterator<T> iterator;
+        typedef basic_iterator<const T> const_iterator;
+
+    protected:
+        T** items_;
+        uint32_t size_;
+        uint32_t capacity_;
+        // number of pson values sharing this container (see pson::share)
+        uint32_t references_;
+        // items kept constructed after the last one for recycling, with their payloads (see truncate)
+        uint32_t spare_;
+        // allocator for the item storage, also inherited by the items (see memory_allocator::index)
+        uint16_t allocator_;
+
+        void destroy_item(T* item){
+            get_allocator().destroy(item);
+        }
+
+        // destroy the spare items, so their slots after the last item are free again
+        void drop_spares(){
+            if(!get_allocator().trivial_deallocate()){
+                for(size_t i=size_ + spare_; i>size_; i--){
+                    destroy_item(items_[i-1]);
+                }
+            }
+            spare_ = 0;
+        }
+
+    public:
+        iterator begin(){
+            return iterator(items_, items_ + size_);
+        }
+
+        iterator end(){
+            return iterator(items_ + size_, items_ + size_);
+        }
+
+        const_iterator begin() const{
+            return const_iterator(items_, items_ + size_);
+        }
+
+        const_iterator end() const{
+            return const_iterator(items_ + size_, items_ + size_);
+        }
+
+        pson_container() : items_(NULL), size_(0), capacity_(0), references_(1), spare_(0), allocator_(0) {
+        }
+
+        explicit pson_container(memory_allocator& allocator) : items_(NULL), size_(0), capacity_(0), references_(1), spare_(0), allocator_(allocator.index()) {
+        }
+
+        pson_container(pson_container&& other) : items_(other.items_), size_(other.size_), capacity_(other.capacity_), references_(1), spare_(other.spare_), allocator_(other.allocator_) {
+            other.items_ = NULL;
+            other.size_ = 0;
+            other.capacity_ = 0;
+            other.spare_ = 0;
+        }
+
+        pson_container& operator=(pson_container&& other){
+            if(this!=&other){
+                release();
+                items_ = other.items_;
+                size_ = other.size_;
+                capacity_ = other.capacity_;
+                allocator_ = other.allocator_;
+                spare_ = other.spare_;
+                other.items_ = NULL;
+                other.size_ = 0;
+                other.capacity_ = 0;
+                other.spare_ = 0;
+            }
+            return *this;
+        }
+
+        // containers own their items, so they can be moved or cloned, but not copied
+        pson_container(const pson_container&) = delete;
+        pson_container& operator=(const pson_container&) = delete;
+
+        ~pson_container(){
+            release();
+        }
+
+        size_t size() const{
+            return size_;
+        }
+
+        size_t capacity() const{
+            return capacity_;
+        }
+
+        memory_allocator& get_allocator() const{
+            return memory_allocator::at(allocator_);
+        }
+
+        bool is_shared() const{
+            return references_>1;
+        }
+
+        bool add_reference(){
+            if(references_==UINT32_MAX) return false;
+            references_++;
+            return true;
+        }
+
+        // returns true when the last reference is removed, so the container must be destroyed
+        bool remove_reference(){
+            return --references_==0;
+        }
+
+        T* operator[](size_t index){
+            return index<size_ ? items_[index] : NULL;
+        }
+
+        const T* operator[](size_t index) const{
+            return index<size_ ? items_[index] : NULL;
+        }
+
+        // empty every item and keep it as a spare, so adding items again does not allocate
+        void clear(){
+            truncate(0);
+            memory_allocator& allocator = get_allocator();
+            bool trivial = allocator.trivial_deallocate();
+            for(size_t i=0; i<spare_; i++){
+                if(!trivial) items_[i]->~T();
+                new (items_[i], NULL) T(allocator);
+            }
+        }
+
+        // destroy every item and return the item storage
+        void release(){
+            truncate(0);
+            drop_spares();
+            get_allocator().deallocate(items_, capacity_ * sizeof(T*));
+            items_ = NULL;
+            capacity_ = 0;
+        }
+
+        /*
+         * Remove the items after the given size, keeping them (and everything they hold) as spares, so
+         * recycle_item() can overwrite them in place, as the decoder does when recycling a tree.
+         */
+        void truncate(size_t size){
+            if(size>=size_) return;
+            spare_ += size_ - size;
+            size_ = size;
+        }
+
+        // the next spare item, with its previous contents, or a new item if there are no spares
+        T* recycle_item(){
+            if(spare_>0){
+                spare_--;
+                return items_[size_++];
+            }
+            return create_item();
+        }
+
+        size_t spare() const{
+            return spare_;
+        }
+
+        // grow the item index, without moving the items themselves
+        bool reserve(size_t capacity){
+            if(capacity<=capacity_) return true;
+            if(capacity>UINT32_MAX) return false;
+            memory_allocator& allocator = get_allocator();
+            T** items = (T**) allocator.allocate(capacity * sizeof(T*));
+            if(items==NULL) return false;
+            if(size_ + spare_ > 0){
+                memcpy(items, items_, (size_ + spare_) * sizeof(T*));
+            }
+            allocator.deallocate(items_, capacity_ * sizeof(T*));
+            items_ = items;
+            capacity_ = capacity;
+            return true;
+        }
+
+        // bytes allocated for the item index, the items (and spares) and everything they hold
+        size_t allocated_size() const{
+            size_t size = capacity_ * sizeof(T*);
+            for(size_t i=0; i<size_ + spare_; i++){
+                size += sizeof(T) + items_[i]->allocated_size();
+            }
+            return size;
+        }
+
+        T* create_item(){
+            memory_allocator& allocator = get_allocator();
+            if(spare_>0){
+                // reuse the memory of a spare item for a new empty one
+                spare_--;
+                T* item = items_[size_];
+                item->~T();
+                return items_[size_++] = new (item, NULL) T(allocator);
+            }
+            if(size_==capacity_ && !reserve(capacity_>0 ? (size_t) capacity_*2 : PSON_CONTAINER_CAPACITY)){
+                return NULL;
+            }
+            T* item = allocator.template allocate<T>(allocator);
+            if(item==NULL) return NULL;
+            return items_[size_++] = item;
+        }
+    };
+
+    class pson_object;
+    class pson_array;
+
+    class pson {
+    public:
+        enum field_type {
+            null_field      = 0,
+            varint_field    = 1,
+            svarint_field   = 2,
+            float_field     = 3,
+            double_field    = 4,
+            true_field      = 5,
+            false_field     = 6,
+            zero_field      = 7,
+            one_field       = 8,
+            string_field    = 9,
+            empty_string    = 10,
+            bytes_field     = 11,
+            empty_bytes     = 12,
+            object_field    = 13,
+            array_field     = 14,
+            empty           = 15
+            // a message tag is encoded in a 128-base varint [1-bit][3-bit wire type][4-bit field]
+            // we have up to 4 bits (0-15) for encoding fields in the first byte
+        };
+
+        // strings shorter than this size are stored inline in the node
+        enum { inline_size = 8 };
+
+        // move source contents into destination, releasing any previous destination data
+        static void swap(pson& source, pson& destination){
+            destination = static_cast<pson&&>(source);
+        }
+
+        bool is_boolean() const{
+            return field_type_ == true_field || field_type_ == false_field;
+        }
+
+        bool is_string() const{
+            return field_type_ == string_field;
+        }
+
+        bool is_bytes() const{
+            return field_type_ == bytes_field;
+        }
+
+        bool is_number() const{
+            return  field_type_ == varint_field     ||
+                    field_type_ == svarint_field    ||
+                    field_type_ == float_field      ||
+                    field_type_ == double_field     ||
+                    field_type_ == zero_field       ||
+                    field_type_ == one_field;
+        }
+
+        bool is_float() const{
+            return  field_type_ == float_field      ||
+                    field_type_ == double_field;
+        }
+
+        bool is_integer() const{
+            return  field_type_ == varint_field     ||
+                    field_type_ == svarint_field    ||
+                    field_type_ == zero_field       ||
+                    field_type_ == one_field;
+        }
+
+        bool is_object() const{
+            return field_type_ == object_field;
+        }
+
+        bool is_array() const{
+            return field_type_ == array_field;
+        }
+
+        bool is_null() const{
+            return field_type_ == null_field;
+        }
+
+        bool is_empty() const{
+            return field_type_ == empty;
+        }
+
+        pson() : size_(0), field_type_(empty), flags_(0), allocator_(0) {
+            value_.pointer = NULL;
+        }
+
+        // values created inside containers inherit the container allocator
+        explicit pson(memory_allocator& allocator) : size_(0), field_type_(empty), flags_(0), allocator_(allocator.index()) {
+            value_.pointer = NULL;
+        }
+
+        template<class T>
+        pson(T value) : size_(0), field_type_(empty), flags_(0), allocator_(0){
+            value_.pointer = NULL;
+            *this = value;
+        }
+
+        pson(pson&& other) : value_(other.value_), size_(other.size_), field_type_(other.field_type_), flags_(other.flags_), allocator_(other.allocator_) {
+            other.value_.pointer = NULL;
+            other.size_ = 0;
+            other.field_type_ = empty;
+            other.flags_ = 0;
+        }
+
+        // values keep their allocator, so moving from a value with a different allocator copies it
+        pson& operator=(pson&& other){
+            if(this!=&other && allocator_!=other.allocator_){
+                // the source keeps its contents if they cannot be copied
+                pson copy(get_allocator());
+                if(other.clone(copy)){
+                    other.release();
+                    *this = static_cast<pson&&>(copy);
+                }
+            }else if(this!=&other){
+                // take the source before releasing, as it can be held by this value (v = move(v["child"]))
+                pson source(static_cast<pson&&>(other));
+                release();
+                value_ = source.value_;
+                size_ = source.size_;
+                field_type_ = source.field_type_;
+                flags_ = source.flags_;
+                source.value_.pointer = NULL;
+                source.size_ = 0;
+                source.field_type_ = empty;
+                source.flags_ = 0;
+            }
+            return *this;
+        }
+
+        // a pson owns its payload: use move semantics or clone() instead of copies
+        pson(const pson&) = delete;
+        pson& operator=(const pson&) = delete;
+
+        ~pson(){
+            release();
+        }
+
+        // deep copy of this value (and all its children) into destination, using its allocator
+        bool clone(pson& destination) const;
+
+        /*
+         * Allocator for the payload of this value and all its children, which is the global pool by
+         * default. Values created inside objects and arrays inherit it. Setting a new allocator
+         * releases the current contents, so set it on empty root values. Returns false, keeping the
+         * current allocator, if the allocator could not be registered (see PSON_MAX_ALLOCATORS).
+         */
+        bool set_allocator(memory_allocator& allocator){
+            if(!allocator.registered()) return false;
+            release();
+            allocator_ = allocator.index();
+            return true;
+        }
+
+        memory_allocator& get_allocator() const{
+            return memory_allocator::at(allocator_);
+        }
+
+        /*
+         * Share this value with destination instead of copying it. Objects and arrays are reference
+         * counted, so destination uses the same storage until one of them is modified: converting a
+         * shared value to pson_object& or pson_array& first copies that level, sharing its children,
+         * so only the modified path is copied. Other values are cloned. Use get_object(), get_array()
+         * and the const getters to read a shared tree without copying it.
+         */
+        bool share(pson& destination) const;
+
+        const pson_object* get_object() const;
+        const pson_array* get_array() const;
+
+        // bytes allocated for this value and all its children, excluding the node itself
+        size_t allocated_size() const;
+
+        // total memory held by this value, including the node itself
+        size_t footprint() const{
+            return sizeof(pson) + allocated_size();
+        }
+
+        template<class T>
+        void operator=(T value)
+        {
+            release();
+            if(value==0){
+                field_type_ = zero_field;
+            }else if(value==1) {
+                field_type_ = one_field;
+            }else{
+                // negate in the unsigned domain, so the minimum signed values do not overflow
+                value_.integer = value>0 ? (uint64_t) value : (uint64_t) 0 - (uint64_t) value;
+                field_type_ = value>0 ? varint_field : svarint_field;
+            }
+        }
+
+        // integer from its magnitude and sign, covering the full range of both, as they are encoded
+        void set_integer(uint64_t magnitude, bool negative){
+            release();
+            if(magnitude<=1 && !(negative && magnitude==1)){
+                field_type_ = magnitude==0 ? zero_field : one_field;
+            }else{
+                value_.integer = magnitude;
+                field_type_ = negative ? svarint_field : varint_field;
+            }
+        }
+
+        void operator=(bool value){
+            release();
+            field_type_ = value ? true_field : false_field;
+        }
+
+        void operator=(float value) {
             if(value==(int32_t)value){
                 *this = (int32_t) value;
             }else{
+                release();
+                value_.single = value;
+                field_type_ = float_field;
+            }
+        }
+
+        void operator=(double value) {
+            if(value==(int64_t)value) {
+                *this = (int64_t) value;
+            }else if(fabs(value-(float)value)<=0.00001){
+                release();
+                value_.single = (float) value;
                 field_type_ = float_field;
-                set(value);
+            }else{
+                release();
+                value_.real = value;
+                field_type_ = double_field;
+            }
+        }
+
+        void operator=(const char *str) {
+            set_string(str, strlen(str));
+        }
+
+        // strings keep their size, so they can also contain null characters
+        void set_string(const char* str, size_t size){
+            if(size==0){
+                release();
+                field_type_ = empty_string;
+            }else if(char* value = allocate_string(size)){
+                memcpy(value, str, size);
+                value[size] = 0;
+            }
+        }
+
+        // reserve room for a string of the given size and its terminator, inline if it fits in the node
+        char* allocate_string(size_t size){
+            // an owned string of the same size is overwritten in place
+            if(field_type_==string_field && size_==size && !is_inline() && !is_reference()){
+                return (char*) value_.pointer;
+            }
+            release();
+            if(size<inline_size){
+                flags_ = inline_string;
+            }else if(size>=UINT32_MAX || !allocate(size+1)){
+                return NULL;
+            }
+            size_ = size;
+            field_type_ = string_field;
+            return (char*) get_value();
+        }
+
+        /*
+         * Reference a string or bytes payload owned by the caller instead of copying it. The
+         * memory must outlive this value (or the next assignment). Referenced strings do not need
+         * to be null terminated: they are copied into owned storage on a const char* conversion,
+         * unless the caller guarantees the terminator with terminated.
+         */
+        void set_string_ref(const char* str, size_t size, bool terminated=false){
+            set_reference(str, size, string_field, empty_string, terminated ? borrowed_value | terminated_value : borrowed_value);
+        }
+
+        void set_bytes_ref(const uint8_t* bytes, size_t size){
+            set_reference(bytes, size, bytes_field, empty_bytes, borrowed_value);
+        }
+
+        bool is_reference() const{
+            return (flags_ & borrowed_value)!=0;
+        }
+
+        void set_bytes(const uint8_t* bytes, size_t size) {
+            if(size>0){
+                if(uint8_t* value = allocate_bytes(size)){
+                    memcpy(value, bytes, size);
+                }
+            }else{
+                release();
+                field_type_ = empty_bytes;
+            }
+        }
+
+        // reserve room for a bytes payload of the given size
+        uint8_t* allocate_bytes(size_t size){
+            // owned bytes of the same size are overwritten in place
+            if(field_type_==bytes_field && size_==size && !is_reference()){
+                return (uint8_t*) value_.pointer;
+            }
+            release();
+            if(size>UINT32_MAX || !allocate(size)){
+                return NULL;
+            }
+            size_ = size;
+            field_type_ = bytes_field;
+            return (uint8_t*) value_.pointer;
+        }
+
+        bool get_bytes(uint8_t *& bytes, size_t& size){
+            switch(field_type_){
+                case bytes_field:
+                    size = size_;
+                    bytes = (uint8_t*) value_.pointer;
+                    return true;
+                case empty:
+                    field_type_ = empty_bytes;
+                default:
+                    return false;
+            }
+        }
+
+        // string contents and size, without requiring a null terminated copy of referenced strings
+        bool get_string(const char *& str, size_t& size){
+            if(field_type_==empty){
+                field_type_ = empty_string;
+            }
+            return ((const pson*) this)->get_string(str, size);
+        }
+
+        bool get_string(const char *& str, size_t& size) const{
+            switch(field_type_){
+                case string_field:
+                    str = (const char*) get_value();
+                    size = size_;
+                    return true;
+                case empty_string:
+                    str = "";
+                    size = 0;
+                    return true;
+                default:
+                    return false;
+            }
+        }
+
+        template <class T>
+        bool allocate(){
+            release_payload();
+            memory_allocator& allocator = get_allocator();
+            value_.pointer = allocator.allocate<T>(allocator);
+            return value_.pointer!=NULL;
+        }
+
+        operator pson_object &();
+        operator pson_array &();
+        pson & operator[](const char *name);
+
+        operator const char *() {
+            switch(field_type_){
+                case string_field:
+                    if(is_reference() && !(flags_ & terminated_value)){
+                        const char* reference = (const char*) value_.pointer;
+                        size_t size = size_;
+                        char* str = allocate_string(size);
+                        if(str==NULL) return "";
+                        memcpy(str, reference, size);
+                        str[size] = 0;
+                    }
+                    return (const char*) get_value();
+                case empty:
+                    field_type_ = empty_string;
+                default:
+                    return "";
+            }
+        }
+
+        operator bool(){
+            switch(field_type_){
+                case zero_field:
+                case false_field:
+                    return false;
+                case one_field:
+                case true_field:
+                    return true;
+                case empty:
+                    field_type_ = false_field;
+                default:
+                    return 0;
+            }
+        }
+
+        operator char(){
+            return get_value<char>();
+        }
+
+        operator unsigned char(){
+            return get_value<unsigned char>();
+        }
+
+        operator short(){
+            return get_value<short>();
+        }
+
+        operator unsigned short(){
+            return get_value<unsigned short>();
+        }
+
+        operator int(){
+            return get_value<int>();
+        }
+
+        operator unsigned int(){
+            return get_value<unsigned int>();
+        }
+
+        operator long(){
+            return get_value<long>();
+        }
+
+        operator unsigned long(){
+            return get_value<unsigned long>();
+        }
+
+        operator float(){
+            return get_value<float>();
+        }
+
+        operator double(){
+            return get_value<double>();
+        }
+
+        template<class T>
+        operator T() {
+            return get_value<T>();
+        }
+
+        template<class T>
+        T get_value(){
+            if(field_type_==empty){
+                field_type_ = zero_field;
+            }
+            return ((const pson*) this)->get_value<T>();
+        }
+
+        template<class T>
+        T get_value() const{
+            switch(field_type_){
+                case zero_field:
+                case false_field:
+                    return 0;
+                case one_field:
+                case true_field:
+                    return 1;
+                case float_field:
+                    return value_.single;
+                case double_field:
+                    return value_.real;
+                case varint_field:
+                    return value_.integer;
+                case svarint_field:
+                    return -value_.integer;
+                default:
+                    return 0;
+            }
+        }
+
+        // pointer to the value payload, either stored inline (numbers) or in allocated memory
+        void* get_value(){
+            return is_inline() ? (void*) &value_ : value_.pointer;
+        }
+
+        const void* get_value() const{
+            return is_inline() ? (const void*) &value_ : value_.pointer;
+        }
+
+        field_type get_type() const{
+            return (field_type) field_type_;
+        }
+
+        void set_null(){
+            set_type(null_field);
+        }
+
+        // change the value type, releasing the previous payload
+        void set_type(field_type type){
+            release();
+            field_type_ = type;
+        }
+
+        uint8_t get_varint_size(uint64_t value) const{
+            uint8_t size = 1;
+            while(value>>=7) size++;
+            return size;
+        }
+
+#ifdef ARDUINO
+        void operator=(const String& str) {
+            set_string(str.c_str(), str.length());
+        }
+
+        operator String(){
+            return (const char*)(*this);
+        }
+#else
+        void operator=(const std::string& str) {
+            set_string(str.data(), str.size());
+        }
+
+        operator std::string(){
+            const char* str = NULL;
+            size_t size = 0;
+            return get_string(str, size) ? std::string(str, size) : std::string();
+        }
+
+        pson & operator[](const std::string& name);
+#if __cplusplus >= 201703L
+        void operator=(std::string_view str) {
+            set_string(str.data(), str.size());
+        }
+
+        pson & operator[](std::string_view name);
+#endif
+#endif
+
+    private:
+        enum value_flags {
+            inline_string   = 1,
+            borrowed_value  = 2,
+            terminated_value = 4
+        };
+
+        // numbers and short strings are stored inline, the remaining payloads are allocated from allocator_
+        union {
+            void* pointer;
+            uint64_t integer;
+            float single;
+            double real;
+            char chars[inline_size];
+        } value_;
+        // size of strings and bytes payloads
+        uint32_t size_;
+        uint8_t field_type_;
+        uint8_t flags_;
+        // index of the allocator, in the padding after the type (see memory_allocator::index)
+        uint16_t allocator_;
+
+        bool is_inline() const{
+            return  field_type_ == varint_field     ||
+                    field_type_ == svarint_field    ||
+                    field_type_ == float_field      ||
+                    field_type_ == double_field     ||
+                    (flags_ & inline_string);
+        }
+
+        void release(){
+            release_payload();
+            field_type_ = empty;
+        }
+
+        /*
+         * Allocate a payload, releasing any previous payload. Callers set size_ to match, so
+         * release_payload() returns the block with its size (see allocate_string and allocate_bytes).
+         */
+        bool allocate(size_t size){
+            release_payload();
+            value_.pointer = get_allocator().allocate(size);
+            return value_.pointer!=NULL;
+        }
+
+        // free the payload owned by this value, keeping its type
+        void release_payload();
+
+        // give this value its own copy of a shared object or array, sharing the children
+        bool detach();
+
+        void set_reference(const void* payload, size_t size, field_type type, field_type empty_type, uint8_t flags){
+            release();
+            if(size==0){
+                field_type_ = empty_type;
+            }else if(size<=UINT32_MAX){
+                value_.pointer = const_cast<void*>(payload);
+                size_ = size;
+                field_type_ = type;
+                flags_ = flags;
+            }
+        }
+    };
+
+    /*
+     * Short names (the common case for object keys) are stored inline in the pair, so they do not
+     * need an extra allocation. Longer names are allocated from the allocator of the value.
+     */
+    class pson_pair{
+    public:
+        // names shorter than this size are stored inline, reusing the padding after the name size
+        enum { inline_name_size = sizeof(char*) + sizeof(uint32_t) };
+
+    private:
+        // both layouts share the size, so it can be read from any of them
+        union {
+            struct {
+                uint32_t size;
+                char chars[inline_name_size];
+            } short_name;
+            struct {
+                uint32_t size;
+                char* pointer;
+            } long_name;
+        } name_;
+        pson value_;
+
+        // pairs without a name keep a NULL long name with this size
+        enum { no_name = UINT32_MAX };
+
+        // long names referenced from memory owned by the caller are flagged in the size
+        enum { borrowed_name = 0x80000000 };
+
+        bool is_inline_name() const{
+            return name_.short_name.size < inline_name_size;
+        }
+
+        bool is_owned_name() const{
+            return !is_inline_name() && !(name_.long_name.size & borrowed_name) && name_.long_name.pointer!=NULL;
+        }
+
+        void release_name(){
+            if(is_owned_name()){
+                value_.get_allocator().deallocate(name_.long_name.pointer, name_.long_name.size + 1);
             }
+            name_.long_name.size = no_name;
+            name_.long_name.pointer = NULL;
         }
 
-        void operator=(double value) {
-            if(value==(int64_t)value) {
-                *this = (int64_t) value;
-            }else if(fabs(value-(float)value)<=0.00001){
-                field_type_ = float_field;
-                set((float)value);
-            }else{
-                field_type_ = double_field;
-                set(value);
+    public:
+        pson_pair(){
+            name_.long_name.size = no_name;
+            name_.long_name.pointer = NULL;
+        }
+
+        explicit pson_pair(memory_allocator& allocator) : value_(allocator){
+            name_.long_name.size = no_name;
+            name_.long_name.pointer = NULL;
+        }
+
+        pson_pair(pson_pair&& other) : name_(other.name_), value_(static_cast<pson&&>(other.value_)){
+            other.name_.long_name.size = no_name;
+            other.name_.long_name.pointer = NULL;
+        }
+
+        pson_pair& operator=(pson_pair&& other){
+            if(this!=&other && &value_.get_allocator()!=&other.value_.get_allocator()){
+                // long names belong to the allocator of the source, so they are copied like the value
+                if(other.name()!=NULL){
+                    set_name(other.name(), other.name_size());
+                }else{
+                    release_name();
+                }
+                other.release_name();
+                value_ = static_cast<pson&&>(other.value_);
+            }else if(this!=&other){
+                release_name();
+                name_ = other.name_;
+                other.name_.long_name.size = no_name;
+                other.name_.long_name.pointer = NULL;
+                value_ = static_cast<pson&&>(other.value_);
             }
+            return *this;
         }
 
-        void operator=(const char *str) {
-            size_t str_size = strlen(str);
-            if(str_size==0){
-                field_type_ = empty_string;
-            }else if(allocate(str_size+1)){
-                memcpy(value_, str, str_size+1);
-                field_type_ = string_field;
+        pson_pair(const pson_pair&) = delete;
+        pson_pair& operator=(const pson_pair&) = delete;
+
+        ~pson_pair(){
+            release_name();
+        }
+
+        void set_name(const char *name) {
+            set_name(name, strlen(name));
+        }
+
+        void set_name(const char *name, size_t size) {
+            if(char* str = allocate_name(size + 1)){
+                memcpy(str, name, size);
+                str[size] = 0;
             }
         }
 
-        void set_bytes(const uint8_t* bytes, size_t size) {
-            if(size>0){
-                size_t varint_size = get_varint_size(size);
-                if(allocate(varint_size+size)){
-                    pb_encode_varint(size);
-                    memcpy(((uint8_t*)value_)+varint_size, bytes, size);
-                    field_type_ = bytes_field;
+        // allocate room for a name, including its null terminator
+        char* allocate_name(size_t size){
+            // an owned name of the same size is overwritten in place
+            if(is_owned_name() && name_.long_name.size==size-1){
+                return name_.long_name.pointer;
+            }
+            release_name();
+            if(size>0 && size<=inline_name_size){
+                name_.short_name.size = size - 1;
+                return name_.short_name.chars;
+            }
+            if(size>0 && size<=borrowed_name){
+                name_.long_name.pointer = (char*)value_.get_allocator().allocate(size);
+                if(name_.long_name.pointer!=NULL){
+                    name_.long_name.size = size - 1;
                 }
-            }else{
-                field_type_ = empty_bytes;
             }
+            return name_.long_name.pointer;
         }
 
-        bool get_bytes(uint8_t *& bytes, size_t& size){
-            switch(field_type_){
-                case bytes_field:
-                    size = pb_decode_varint();
-                    bytes = (uint8_t*) value_ + get_varint_size(size);
-                    return true;
-                case empty:
-                    field_type_ = empty_bytes;
-                default:
-                    return false;
+        /*
+         * Reference a null terminated name owned by the caller, which must outlive this pair. Short
+         * names are still copied, as they are stored inline.
+         */
+        void set_name_ref(const char* name, size_t size){
+            if(size<inline_name_size || size>=borrowed_name){
+                set_name(name, size);
+                return;
             }
+            release_name();
+            name_.long_name.pointer = const_cast<char*>(name);
+            name_.long_name.size = size | borrowed_name;
         }
 
-        bool allocate(size_t size){
-            if(value_ == NULL){
-                value_ = pool.allocate(size);
-                return value_!=NULL;
+        pson& value(){
+            return value_;
+        }
+
+        char* name() const{
+            return is_inline_name() ? const_cast<char*>(name_.short_name.chars) : name_.long_name.pointer;
+        }
+
+        size_t name_size() const{
+            return name_.long_name.size!=no_name ? name_.long_name.size & ~(uint32_t)borrowed_name : 0;
+        }
+
+        const pson& value() const{
+            return value_;
+        }
+
+        // bytes allocated for this pair, excluding the pair itself
+        size_t allocated_size() const{
+            return (is_owned_name() ? name_.long_name.size + 1 : 0) + value_.allocated_size();
+        }
+    };
+
+    /*
+     * Objects keep their pairs in insertion order by default. With sorted keys enabled, pairs are kept
+     * ordered by name, so lookups use a binary search and the encoded output has a canonical key order.
+     */
+    class pson_object : public pson_container<pson_pair> {
+    private:
+        bool sorted_;
+
+        friend class pson_decoder;
+
+        static int compare(const pson_pair& pair, const char* name, size_t size){
+            size_t pair_size = pair.name_size();
+            size_t common = pair_size<size ? pair_size : size;
+            int result = common>0 ? memcmp(pair.name(), name, common) : 0;
+            if(result!=0) return result;
+            return pair_size<size ? -1 : (pair_size>size ? 1 : 0);
+        }
+
+        // index of the first of the count pairs whose name is not less (or greater, if upper) than name
+        size_t bound(const char* name, size_t size, bool upper, size_t count) const{
+            size_t low = 0;
+            size_t high = count;
+            while(low<high){
+                size_t middle = low + (high-low)/2;
+                int result = compare(*items_[middle], name, size);
+                if(result<0 || (upper && result==0)){
+                    low = middle + 1;
+                }else{
+                    high = middle;
+                }
             }
-            return false;
+            return low;
         }
 
-        template <class T>
-        bool allocate(){
-            if(value_ == NULL){
-                value_ = pool.allocate<T>();
-                return value_!=NULL;
+        // move the pair at index to the given position, shifting the pairs in between
+        pson_pair& move_item(size_t index, size_t position){
+            if(index!=position){
+                pson_pair* item = items_[index];
+                for(; index>position; index--){
+                    items_[index] = items_[index-1];
+                }
+                items_[position] = item;
             }
-            return false;
+            return *items_[position];
         }
 
-        operator pson_object &();
-        operator pson_array &();
-        pson & operator[](const char *name);
+        // place the last pair at its sorted position, after any pair with the same name
+        pson_pair& sort_last(){
+            pson_pair& last = *items_[size_-1];
+            return move_item(size_-1, bound(last.name(), last.name_size(), true, size_-1));
+        }
 
-        operator const char *() {
-            switch(field_type_){
-                case string_field:
-                    return (const char*) value_;
-                case empty:
-                    field_type_ = empty_string;
-                default:
-                    return "";
+    public:
+
+        pson_object() : sorted_(false){
+        }
+
+        explicit pson_object(memory_allocator& allocator) : pson_container<pson_pair>(allocator), sorted_(false){
+        }
+
+        bool sorted_keys() const{
+            return sorted_;
+        }
+
+        // keep pairs ordered by name, optionally also in nested objects
+        void set_sorted_keys(bool sorted, bool recursive=false);
+
+        pson* find(const char* name, size_t size){
+            if(sorted_){
+                size_t index = bound(name, size, false, size_);
+                if(index<size_ && compare(*items_[index], name, size)==0){
+                    return &items_[index]->value();
+                }
+            }else{
+                for(iterator it=begin(); it.valid(); it.next()){
+                    if(it.item().name()!=NULL && compare(it.item(), name, size)==0){
+                        return &it.item().value();
+                    }
+                }
             }
+            return NULL;
         }
 
-        operator bool(){
-            switch(field_type_){
-                case zero_field:
-                case false_field:
-                    return false;
-                case one_field:
-                case true_field:
-                    return true;
-                case empty:
-                    field_type_ = false_field;
-                default:
-                    return 0;
+        pson* find(const char* name){
+            return find(name, strlen(name));
+        }
+
+        const pson* find(const char* name, size_t size) const{
+            return const_cast<pson_object*>(this)->find(name, size);
+        }
+
+        const pson* find(const char* name) const{
+            return find(name, strlen(name));
+        }
+
+        // value stored under the given name, which is created if it does not exist
+        pson& get(const char* name, size_t size){
+            if(pson* value = find(name, size)){
+                return *value;
+            }
+            if(pson_pair* pair = create_item()){
+                if(sorted_){
+                    pair = &move_item(size_-1, bound(name, size, false, size_-1));
+                }
+                pair->set_name(name, size);
+                return pair->value();
+            }else{
+                static pson value;
+                return value;
             }
         }
 
-        operator char(){
-            return get_value<char>();
+        pson &operator[](const char *name) {
+            return get(name, strlen(name));
+        };
+
+#ifndef ARDUINO
+        pson &operator[](const std::string& name) {
+            return get(name.data(), name.size());
+        };
+#if __cplusplus >= 201703L
+        pson &operator[](std::string_view name) {
+            return get(name.data(), name.size());
+        };
+#endif
+#endif
+    };
+
+    class pson_array : public pson_container<pson> {
+    public:
+        pson_array(){
         }
 
-        operator unsigned char(){
-            return get_value<unsigned char>();
+        explicit pson_array(memory_allocator& allocator) : pson_container<pson>(allocator){
         }
 
-        operator short(){
-            return get_value<short>();
+        template<class T>
+        pson_array& add(T item_value){
+            pson* item = create_item();
+            if(item!=NULL){
+                *item = item_value;
+            }
+            return *this;
         }
 
-        operator unsigned short(){
-            return get_value<unsigned short>();
+        pson_array& add_array(){
+            pson* item = create_item();
+            if(item!=NULL){
+                return (pson_array&) *item;
+            }else{
+                static pson_array dummy;
+                return dummy;
+            }
         }
 
-        operator int(){
-            return get_value<int>();
+        pson_object& add_object(){
+            pson* item = create_item();
+            if(item!=NULL){
+                return (pson_object&) *item;
+            }else{
+                static pson_object dummy;
+                return dummy;
+            }
         }
 
-        operator unsigned int(){
-            return get_value<unsigned int>();
+        bool pop(){
+            if(size_==0) return false;
+            drop_spares();
+            destroy_item(items_[--size_]);
+            return true;
         }
+    };
 
-        operator long(){
-            return get_value<long>();
+    inline pson::operator pson_object &() {
+        if (field_type_ != object_field) {
+            release();
+            value_.pointer = get_allocator().allocate<pson_object>(get_allocator());
+            field_type_ = value_.pointer != NULL ? object_field : empty;
+        }
+        if(value_.pointer!=NULL && field_type_ == object_field && detach()){
+            return *((pson_object *)value_.pointer);
+        }else{
+            static pson_object dummy;
+            return dummy;
         }
+    }
 
-        operator unsigned long(){
-            return get_value<unsigned long>();
+    inline pson::operator pson_array &() {
+        if (field_type_ != array_field) {
+            release();
+            value_.pointer = get_allocator().allocate<pson_array>(get_allocator());
+            field_type_ = value_.pointer!=NULL ? array_field : empty;
+        }
+        if(value_.pointer!=NULL && field_type_==array_field && detach()){
+            return *((pson_array *)value_.pointer);
+        }else{
+            static pson_array dummy;
+            return dummy;
         }
+    }
 
-        operator float(){
-            return get_value<float>();
+    inline pson &pson::operator[](const char *name) {
+        return ((pson_object &) *this)[name];
+    }
+
+#ifndef ARDUINO
+    inline pson &pson::operator[](const std::string& name) {
+        return ((pson_object &) *this)[name];
+    }
+
+#if __cplusplus >= 201703L
+    inline pson &pson::operator[](std::string_view name) {
+        return ((pson_object &) *this)[name];
+    }
+#endif
+#endif
+
+    inline void pson_object::set_sorted_keys(bool sorted, bool recursive) {
+        if(sorted && !sorted_){
+            // stable insertion sort, so pairs sharing a name keep their relative order
+            for(size_t i=1; i<size_; i++){
+                move_item(i, bound(items_[i]->name(), items_[i]->name_size(), true, i));
+            }
+        }
+        sorted_ = sorted;
+        if(!recursive) return;
+        for(iterator it=begin(); it.valid(); it.next()){
+            pson& value = it.item().value();
+            if(value.is_object()){
+                ((pson_object&)value).set_sorted_keys(sorted, true);
+            }else if(value.is_array()){
+                pson_array& array = value;
+                for(pson_array::iterator item=array.begin(); item.valid(); item.next()){
+                    if(item.item().is_object()){
+                        ((pson_object&)item.item()).set_sorted_keys(sorted, true);
+                    }
+                }
+            }
         }
+    }
 
-        operator double(){
-            return get_value<double>();
+    inline const pson_object* pson::get_object() const {
+        return field_type_==object_field ? (const pson_object *) value_.pointer : NULL;
+    }
+
+    inline const pson_array* pson::get_array() const {
+        return field_type_==array_field ? (const pson_array *) value_.pointer : NULL;
+    }
+
+    inline bool pson::share(pson& destination) const {
+        if(&destination==this) return true;
+        // containers can only be shared by values using the same allocator
+        if(value_.pointer!=NULL && destination.allocator_==allocator_){
+            bool shared = false;
+            if(field_type_==object_field){
+                shared = ((pson_object *) value_.pointer)->add_reference();
+            }else if(field_type_==array_field){
+                shared = ((pson_array *) value_.pointer)->add_reference();
+            }
+            if(shared){
+                destination.release();
+                destination.value_.pointer = value_.pointer;
+                destination.field_type_ = field_type_;
+                return true;
+            }
         }
+        return clone(destination);
+    }
 
-        template<class T>
-        operator T() {
-            return get_value<T>();
+    inline bool pson::detach() {
+        if(field_type_==object_field){
+            pson_object* source = (pson_object *) value_.pointer;
+            if(!source->is_shared()) return true;
+            pson_object* object = get_allocator().allocate<pson_object>(get_allocator());
+            if(object==NULL) return false;
+            object->set_sorted_keys(source->sorted_keys());
+            bool copied = object->reserve(source->size());
+            for(pson_object::iterator it=source->begin(); copied && it.valid(); it.next()){
+                pson_pair* pair = object->create_item();
+                if(pair!=NULL && it.item().name()!=NULL){
+                    pair->set_name(it.item().name(), it.item().name_size());
+                    copied = pair->name()!=NULL;
+                }
+                copied = copied && pair!=NULL && it.item().value().share(pair->value());
+            }
+            if(!copied){
+                get_allocator().destroy(object);
+                return false;
+            }
+            source->remove_reference();
+            value_.pointer = object;
+        }else if(field_type_==array_field){
+            pson_array* source = (pson_array *) value_.pointer;
+            if(!source->is_shared()) return true;
+            pson_array* array = get_allocator().allocate<pson_array>(get_allocator());
+            if(array==NULL) return false;
+            bool copied = array->reserve(source->size());
+            for(pson_array::iterator it=source->begin(); copied && it.valid(); it.next()){
+                pson* item = array->create_item();
+                copied = item!=NULL && it.item().share(*item);
+            }
+            if(!copied){
+                get_allocator().destroy(array);
+                return false;
+            }
+            source->remove_reference();
+            value_.pointer = array;
         }
+        return true;
+    }
 
-        template<class T>
-        T get_value(){
-            switch(field_type_){
-                case zero_field:
-                case false_field:
-                    return 0;
-                case one_field:
-                case true_field:
-                    return 1;
-                case float_field:
-                    return *(float*)value_;
-                case double_field:
-                    return *(double*)value_;
-                case varint_field:
-                    return pb_decode_varint();
-                case svarint_field:
-                    return -pb_decode_varint();
-                case empty:
-                    field_type_ = zero_field;
-                default:
-                    return 0;
+    inline void pson::release_payload() {
+        if(field_type_==object_field){
+            pson_object* object = (pson_object *) value_.pointer;
+            if(object!=NULL && object->remove_reference()){
+                get_allocator().destroy(object);
+            }
+        }else if(field_type_==array_field) {
+            pson_array* array = (pson_array *) value_.pointer;
+            if(array!=NULL && array->remove_reference()){
+                get_allocator().destroy(array);
+            }
+        }else if(!is_inline() && !is_reference()){
+            get_allocator().deallocate(value_.pointer, field_type_==string_field ? size_ + 1 : size_);
+        }
+        value_.pointer = NULL;
+        size_ = 0;
+        flags_ = 0;
+    }
+
+    inline size_t pson::allocated_size() const {
+        if(value_.pointer==NULL) return 0;
+        switch(field_type_){
+            case object_field:
+                return sizeof(pson_object) + ((const pson_object *) value_.pointer)->allocated_size();
+            case array_field:
+                return sizeof(pson_array) + ((const pson_array *) value_.pointer)->allocated_size();
+            case string_field:
+                return is_inline() || is_reference() ? 0 : size_ + 1;
+            case bytes_field:
+                return is_reference() ? 0 : size_;
+            default:
+                return 0;
+        }
+    }
+
+    inline bool pson::clone(pson& destination) const {
+        if(&destination==this) return true;
+        destination.release();
+        switch(field_type_){
+            case varint_field:
+            case svarint_field:
+            case float_field:
+            case double_field:
+                destination.value_ = value_;
+                break;
+            case string_field: {
+                destination.set_string((const char*) get_value(), size_);
+                return destination.field_type_==string_field;
+            }
+            case bytes_field:
+                destination.set_bytes((const uint8_t*) value_.pointer, size_);
+                return destination.field_type_==bytes_field;
+            case object_field: {
+                if(!destination.allocate<pson_object>()) return false;
+                destination.field_type_ = object_field;
+                pson_object& source_object = *(pson_object*) value_.pointer;
+                pson_object& destination_object = *(pson_object*) destination.value_.pointer;
+                for(pson_object::iterator it=source_object.begin(); it.valid(); it.next()){
+                    pson_pair* pair = destination_object.create_item();
+                    if(pair==NULL) return false;
+                    if(it.item().name()!=NULL){
+                        pair->set_name(it.item().name(), it.item().name_size());
+                        if(pair->name()==NULL) return false;
+                    }
+                    if(!it.item().value().clone(pair->value())) return false;
+                }
+                return true;
+            }
+            case array_field: {
+                if(!destination.allocate<pson_array>()) return false;
+                destination.field_type_ = array_field;
+                pson_array& source_array = *(pson_array*) value_.pointer;
+                pson_array& destination_array = *(pson_array*) destination.value_.pointer;
+                for(pson_array::iterator it=source_array.begin(); it.valid(); it.next()){
+                    pson* item = destination_array.create_item();
+                    if(item==NULL || !it.item().clone(*item)) return false;
+                }
+                return true;
             }
+            default:
+                break;
         }
+        destination.field_type_ = field_type_;
+        return true;
+    }
 
-        void* get_value(){
-            return value_;
+    /*
+     * Receives the contents of an encoded document in order, as pson_decoder::walk() reads them,
+     * without building a tree. Every event returns false to stop the walk, and does nothing by
+     * default, so handlers only override the events they need. Object values are preceded by their
+     * key, and containers end with their end event. Strings, names and bytes are only valid during
+     * the call, and are not null terminated.
+     */
+    class pson_handler{
+    public:
+        virtual bool null(){
+            return true;
         }
 
-        field_type get_type() const{
-            return field_type_;
+        virtual bool boolean(bool){
+            return true;
         }
 
-        void set_null(){
-            field_type_ = null_field;
-            // TODO free existing value_ (if any)
+        // integers are reported as encoded, with their magnitude and sign, covering both full ranges
+        virtual bool integer(uint64_t, bool){
+            return true;
         }
 
-        void set_type(field_type type){
-            field_type_ = type;
+        virtual bool real(double){
+            return true;
         }
 
-        uint8_t get_varint_size(uint64_t value) const{
-            uint8_t size = 1;
-            while(value>>=7) size++;
-            return size;
+        // floats are reported as doubles unless overridden
+        virtual bool single(float value){
+            return real(value);
         }
 
-        void pb_encode_varint(uint64_t value) const
-        {
-            uint8_t count = 0;
-            do
-            {
-                uint8_t byte = (uint8_t)(value & 0x7F);
-                value >>= 7;
-                if(value) byte |= 0x80;
-                ((uint8_t*)value_)[count] = byte;
-                count++;
-            }while(value);
+        virtual bool string(const char*, size_t){
+            return true;
         }
 
-        uint64_t pb_decode_varint() const
-        {
-            if(value_==NULL) return 0;
-            uint64_t value = 0;
-            uint8_t pos = 0;
-            uint8_t byte = 0;
-            do{
-                byte = ((uint8_t*)value_)[pos];
-                value |= (uint64_t)(byte&0x7F) << pos*7;
-                pos++;
-            }while(byte>=0x80);
-            return value;
+        virtual bool bytes(const uint8_t*, size_t){
+            return true;
         }
 
-#ifdef ARDUINO
-        void operator=(const String& str) {
-            (*this) = str.c_str();
+        virtual bool start_object(){
+            return true;
         }
 
-        operator String(){
-            return (const char*)(*this);
-        }
-#else
-        void operator=(const std::string& str) {
-            (*this) = str.c_str();
+        virtual bool key(const char*, size_t){
+            return true;
         }
 
-        operator std::string(){
-            return (const char*)(*this);
+        virtual bool end_object(){
+            return true;
         }
-#endif
 
-    private:
-        void* value_;
-        field_type field_type_;
+        virtual bool start_array(){
+            return true;
+        }
 
-        template<class T>
-        void set(T value) {
-            if(allocate(sizeof(T))){
-                memcpy(value_, &value, sizeof(T));
-            }
+        virtual bool end_array(){
+            return true;
         }
     };
 
-    class pson_pair{
+    /*
+     * Contiguous storage for the strings and long names of decoded documents (see
+     * pson_decoder::set_string_heap). Strings are appended to large chunks taken from the allocator,
+     * and identical strings are stored once, so repeated values and keys cost neither an allocation
+     * nor extra memory. Decoded values reference the heap, which must outlive them, and it is released
+     * all at once by clear() or when it is destroyed.
+     */
+    class pson_string_heap{
     private:
-        char* name_;
-        pson value_;
-    public:
-        pson_pair() : name_(NULL){
-        }
+        struct chunk{
+            chunk* next;
+            size_t size;
+        };
 
-        ~pson_pair(){
-            pool.deallocate(name_);
-        }
+        struct entry{
+            const char* str;
+            uint32_t size;
+            uint32_t hash;
+        };
 
-        void set_name(const char *name) {
-            size_t name_size = strlen(name) + 1;
-            if(allocate_name(name_size)){
-                memcpy(name_, name, name_size);
+        enum {
+            header_size = sizeof(chunk)
+        };
+
+        memory_allocator& allocator_;
+        chunk* chunks_;
+        size_t chunk_size_;
+        size_t index_;
+        // open addressing table with the unique strings, kept at most half full
+        entry* table_;
+        size_t table_size_;
+        size_t strings_;
+        size_t bytes_;
+        size_t deduplicated_;
+
+        static uint32_t hash(const char* str, size_t size){
+            uint32_t hash = 2166136261u;
+            for(size_t i=0; i<size; i++){
+                hash = (hash ^ (uint8_t) str[i]) * 16777619u;
             }
+            return hash;
         }
 
-        char* allocate_name(size_t size){
-            name_ = (char*)pool.allocate(size);
-            return name_;
+        bool grow_table(){
+            size_t table_size = table_size_ > 0 ? table_size_ * 2 : 64;
+            entry* table = (entry*) allocator_.allocate(table_size * sizeof(entry));
+            if(table==NULL) return false;
+            for(size_t i=0; i<table_size; i++){
+                table[i].str = NULL;
+            }
+            for(size_t i=0; i<table_size_; i++){
+                if(table_[i].str!=NULL){
+                    size_t position = table_[i].hash & (table_size - 1);
+                    while(table[position].str!=NULL){
+                        position = (position + 1) & (table_size - 1);
+                    }
+                    table[position] = table_[i];
+                }
+            }
+            allocator_.deallocate(table_, table_size_ * sizeof(entry));
+            table_ = table;
+            table_size_ = table_size;
+            return true;
         }
 
-        pson& value(){
-            return value_;
+    public:
+        explicit pson_string_heap(memory_allocator& allocator = pool, size_t chunk_size=1024) :
+            allocator_(allocator), chunks_(NULL), chunk_size_(chunk_size), index_(0),
+            table_(NULL), table_size_(0), strings_(0), bytes_(0), deduplicated_(0) {
         }
 
-        char* name() const{
-            return name_;
-        }
-    };
+        pson_string_heap(const pson_string_heap&) = delete;
+        pson_string_heap& operator=(const pson_string_heap&) = delete;
 
-    class pson_object : public pson_container<pson_pair> {
-    public:
+        ~pson_string_heap(){
+            clear();
+        }
 
-        pson &operator[](const char *name) {
-            for(iterator it=begin(); it.valid(); it.next()){
-                const char* item_name = it.item().name();
-                if(item_name && strcmp(item_name, name)==0){
-                    return it.item().value();
-                }
-            }
-            if(pson_pair* pair = create_item()){
-                pair->set_name(name);
-                return pair->value();
-            }else{
-                static pson value;
-                return value;
+        // room for a string of the given size (and its terminator) at the end of the heap
+        char* reserve(size_t size){
+            if(chunks_==NULL || index_ + size + 1 > chunks_->size){
+                size_t chunk_size = size + 1 > chunk_size_ ? size + 1 : chunk_size_;
+                chunk* new_chunk = (chunk*) allocator_.allocate(header_size + chunk_size);
+                if(new_chunk==NULL) return NULL;
+                new_chunk->next = chunks_;
+                new_chunk->size = chunk_size;
+                chunks_ = new_chunk;
+                index_ = 0;
             }
-        };
-    };
-
-    class pson_array : public pson_container<pson> {
-    public:
-        template<class T>
-        pson_array& add(T item_value){
-            pson* item = create_item();
-            if(item!=NULL){
-                *item = item_value;
+            return (char*) chunks_ + header_size + index_;
+        }
+
+        /*
+         * Store the string written in the last reserved room, returning a previous copy of the same
+         * string if there is one, so the room is reused by the next string.
+         */
+        const char* commit(size_t size){
+            char* str = (char*) chunks_ + header_size + index_;
+            str[size] = 0;
+            uint32_t str_hash = hash(str, size);
+            if((strings_ + 1) * 2 <= table_size_ || grow_table()){
+                size_t position = str_hash & (table_size_ - 1);
+                while(table_[position].str!=NULL){
+                    const entry& current = table_[position];
+                    if(current.hash==str_hash && current.size==size && memcmp(current.str, str, size)==0){
+                        deduplicated_++;
+                        return current.str;
+                    }
+                    position = (position + 1) & (table_size_ - 1);
+                }
+                table_[position].str = str;
+                table_[position].size = (uint32_t) size;
+                table_[position].hash = str_hash;
             }
-            return *this;
+            index_ += size + 1;
+            strings_++;
+            bytes_ += size + 1;
+            return str;
         }
 
-        pson_array& add_array(){
-            pson* item = create_item();
-            if(item!=NULL){
-                return (pson_array&) *item;
-            }else{
-                static pson_array dummy;
-                return dummy;
-            }
+        const char* intern(const char* str, size_t size){
+            char* room = reserve(size);
+            if(room==NULL) return NULL;
+            memcpy(room, str, size);
+            return commit(size);
         }
 
-        pson_object& add_object(){
-            pson* item = create_item();
-            if(item!=NULL){
-                return (pson_object&) *item;
-            }else{
-                static pson_object dummy;
-                return dummy;
+        // release every string, which must no longer be referenced
+        void clear(){
+            while(chunks_!=NULL){
+                chunk* next = chunks_->next;
+                allocator_.deallocate(chunks_, header_size + chunks_->size);
+                chunks_ = next;
             }
+            allocator_.deallocate(table_, table_size_ * sizeof(entry));
+            table_ = NULL;
+            table_size_ = 0;
+            index_ = 0;
+            strings_ = 0;
+            bytes_ = 0;
+            deduplicated_ = 0;
         }
 
-        bool pop(){
-            if(last_==NULL) return false;
-            if(item_==last_){
-                pool.destroy(last_);
-                item_ = NULL;
-                last_ = NULL;
-            }else{
-                list_item* previous = last_->previous_;
-                pool.destroy(last_);
-                previous->next_ = NULL;
-                last_ = previous;
-            }
-            return true;
+        // unique strings stored
+        size_t strings() const{
+            return strings_;
         }
-    };
 
-    inline pson::operator pson_object &() {
-        if (field_type_ != object_field) {
-            value_ = pool.allocate<pson_object>();
-            field_type_ = value_ != NULL ? object_field : empty;
-        }
-        if(value_!=NULL && field_type_ == object_field){
-            return *((pson_object *)value_);
-        }else{
-            static pson_object dummy;
-            return dummy;
+        // bytes used by the unique strings, including their terminators
+        size_t bytes() const{
+            return bytes_;
         }
-    }
 
-    inline pson::operator pson_array &() {
-        if (field_type_ != array_field) {
-            value_ = pool.allocate<pson_array>();
-            field_type_ = value_!=NULL ? array_field : empty;
-        }
-        if(value_!=NULL && field_type_==array_field){
-            return *((pson_array *)value_);
-        }else{
-            static pson_array dummy;
-            return dummy;
+        // strings that reused a previous copy
+        size_t deduplicated() const{
+            return deduplicated_;
         }
-    }
-
-    inline pson &pson::operator[](const char *name) {
-        return ((pson_object &) *this)[name];
-    }
+    };
 
     ////////////////////////////
     /////// PSON_DECODER ///////
@@ -752,15 +2418,55 @@ namespace protoson {
 
     protected:
         size_t read_;
+        const uint8_t* input_;
+        size_t input_size_;
+        bool sorted_keys_;
+        bool zero_copy_;
+        memory_allocator* allocator_;
+        pson_string_heap* string_heap_;
+        bool recycle_;
 
         virtual bool read(void* buffer, size_t size){
             read_+=size;
             return true;
         }
 
+        /*
+         * Memory backed decoders can override this method to return a pointer to the next size
+         * bytes of the input (advancing read_), so zero copy decoding can reference them in place.
+         */
+        virtual const void* read_reference(size_t){
+            return NULL;
+        }
+
+        /*
+         * Memory backed decoders can also hand their whole input to the decoder, which then reads it
+         * directly, without calling read() or read_reference() for every field.
+         */
+        void set_input(const void* input, size_t size){
+            input_ = (const uint8_t*) input;
+            input_size_ = size;
+        }
+
+        bool read_input(void* buffer, size_t size){
+            if(input_==NULL) return read(buffer, size);
+            if(size>input_size_-read_) return false;
+            memcpy(buffer, input_ + read_, size);
+            read_ += size;
+            return true;
+        }
+
+        const void* reference_input(size_t size){
+            if(input_==NULL) return read_reference(size);
+            if(size>input_size_-read_) return NULL;
+            const void* reference = input_ + read_;
+            read_ += size;
+            return reference;
+        }
+
     public:
 
-        pson_decoder() : read_(0) {
+        pson_decoder() : read_(0), input_(NULL), input_size_(0), sorted_keys_(false), zero_copy_(false), allocator_(NULL), string_heap_(NULL), recycle_(false) {
 
         }
 
@@ -768,6 +2474,42 @@ namespace protoson {
             read_ = 0;
         }
 
+        // decode objects with sorted keys, i.e., with binary search lookups and canonical encoding
+        void set_sorted_keys(bool sorted){
+            sorted_keys_ = sorted;
+        }
+
+        // decode strings and bytes as references into the input, which must outlive the decoded values
+        void set_zero_copy(bool zero_copy){
+            zero_copy_ = zero_copy;
+        }
+
+        /*
+         * Decode values into the given allocator instead of the allocator of the destination value,
+         * which is rebound (and released) before decoding. Use NULL to keep the value allocator.
+         */
+        void set_allocator(memory_allocator* allocator){
+            allocator_ = allocator;
+        }
+
+        /*
+         * Store decoded strings and long names in the given heap, deduplicated, instead of allocating
+         * each one. The heap must outlive the decoded values. Use NULL to allocate them again.
+         */
+        void set_string_heap(pson_string_heap* string_heap){
+            string_heap_ = string_heap;
+        }
+
+        /*
+         * Decode into the existing contents of the destination value, for messages decoded in a loop
+         * with the same shape. Containers, pairs, strings and bytes are overwritten in place, and
+         * surplus items are kept as spares for the next message, so same shaped messages are decoded
+         * without allocations once the tree is built.
+         */
+        void set_recycle(bool recycle){
+            recycle_ = recycle;
+        }
+
         size_t bytes_read(){
             return read_;
         }
@@ -783,10 +2525,18 @@ namespace protoson {
 
         bool pb_decode_varint32(uint32_t& varint){
             varint = 0;
+            if(input_!=NULL){
+                for(uint8_t bit_pos=0; read_<input_size_ && bit_pos<32; bit_pos+=7){
+                    uint8_t byte = input_[read_++];
+                    varint |= (uint32_t)(byte&0x7F) << bit_pos;
+                    if(byte<0x80) return true;
+                }
+                return false;
+            }
             uint8_t byte;
             uint8_t bit_pos = 0;
             do{
-                if(!read(&byte, 1) || bit_pos>=32){
+                if(!read_input(&byte, 1) || bit_pos>=32){
                     return false;
                 }
                 varint |= (uint32_t)(byte&0x7F) << bit_pos;
@@ -798,13 +2548,21 @@ namespace protoson {
         bool pb_decode_varint64(uint64_t& varint)
         {
             varint = 0;
+            if(input_!=NULL){
+                for(uint8_t bit_pos=0; read_<input_size_ && bit_pos<64; bit_pos+=7){
+                    uint8_t byte = input_[read_++];
+                    varint |= (uint64_t)(byte&0x7F) << bit_pos;
+                    if(byte<0x80) return true;
+                }
+                return false;
+            }
             uint8_t byte;
             uint8_t bit_pos = 0;
             do{
-                if(!read(&byte, 1) || bit_pos>=64){
+                if(!read_input(&byte, 1) || bit_pos>=64){
                     return false;
                 }
-                varint |= (uint32_t)(byte&0x7F) << bit_pos;
+                varint |= (uint64_t)(byte&0x7F) << bit_pos;
                 bit_pos += 7;
             }while(byte>=0x80);
             return true;
@@ -814,63 +2572,201 @@ namespace protoson {
             uint8_t byte;
             bool success = true;
             for(size_t i=0; i<size && success; i++){
-                success = read(&byte, 1);
+                success = read_input(&byte, 1);
             }
             return success;
         }
 
         bool pb_skip_varint(){
             uint8_t byte;
-            bool success;
             do{
-                success = read(&byte, 1);
-            }while(byte>0x80 && success);
-            return success;
+                if(!read_input(&byte, 1)) return false;
+            }while(byte>=0x80);
+            return true;
         }
 
         bool pb_read_string(char *str, size_t size){
-            if(str && read(str, size)){
+            if(str && read_input(str, size)){
                 str[size]=0;
                 return true;
             }
             return false;
         }
 
+        const char* pb_read_heap_string(size_t size){
+            char* str = string_heap_->reserve(size);
+            if(str && read_input(str, size)){
+                return string_heap_->commit(size);
+            }
+            return NULL;
+        }
+
+        // integer values are decoded straight into the native magnitude held by the node
         bool pb_read_varint(pson& value)
         {
-            uint8_t temp[10];
-            uint8_t byte=0;
-            uint8_t bytes_read=0;
-            do{
-                if(bytes_read==10 || !read(&byte, 1)) return false;
-                temp[bytes_read] = byte;
-                bytes_read++;
-            }while(byte>=0x80);
-            if(value.allocate(bytes_read)){
-                memcpy(value.get_value(), temp, bytes_read);
-                return true;
-            }else{
-                return false;
+            return pb_decode_varint64(*(uint64_t*) value.get_value());
+        }
+
+        enum payload_type {
+            string_payload,
+            bytes_payload,
+            name_payload
+        };
+
+        // report a string, bytes or name payload, referenced in place if the input allows it
+        bool walk_payload(pson_handler& handler, payload_type type, size_t size){
+            char buffer[64];
+            void* memory = NULL;
+            const void* payload = reference_input(size);
+            if(payload==NULL){
+                memory = size<=sizeof(buffer) ? buffer : (allocator_!=NULL ? allocator_ : &pool)->allocate(size);
+                if(memory==NULL) return false;
+                payload = memory;
+            }
+            bool result = (memory==NULL || read_input(memory, size));
+            if(result){
+                switch(type){
+                    case string_payload:
+                        result = handler.string((const char*) payload, size);
+                        break;
+                    case bytes_payload:
+                        result = handler.bytes((const uint8_t*) payload, size);
+                        break;
+                    case name_payload:
+                        result = handler.key((const char*) payload, size);
+                        break;
+                }
+            }
+            if(memory!=NULL && memory!=buffer){
+                (allocator_!=NULL ? allocator_ : &pool)->deallocate(memory, size);
+            }
+            return result;
+        }
+
+        bool walk_object(pson_handler& handler, size_t size){
+            size_t start_read = bytes_read();
+            while(size-(bytes_read()-start_read)>0){
+                uint32_t name_size;
+                if(!pb_decode_varint32(name_size) || name_size==UINT32_MAX) return false;
+                if(!walk_payload(handler, name_payload, name_size) || !walk(handler)) return false;
+            }
+            return true;
+        }
+
+        bool walk_array(pson_handler& handler, size_t size){
+            size_t start_read = bytes_read();
+            while(size-(bytes_read()-start_read)>0){
+                if(!walk(handler)) return false;
+            }
+            return true;
+        }
+
+        // whether the payload of value can be overwritten in place with a value of the given type
+        static bool recyclable(pson& value, pson::field_type type){
+            if(value.get_type()!=type) return false;
+            switch(type){
+                case pson::string_field:
+                case pson::bytes_field:
+                    return true;
+                case pson::object_field:
+                    return !((pson_object*) value.get_value())->is_shared();
+                case pson::array_field:
+                    return !((pson_array*) value.get_value())->is_shared();
+                default:
+                    return false;
             }
         }
 
     public:
 
+        /*
+         * Read an encoded value, reporting its contents to the handler instead of building a tree.
+         * Strings and bytes are referenced in place by memory backed decoders (see read_reference),
+         * so contiguous input is walked without copying them. Returns false on invalid input, or when
+         * the handler stops the walk.
+         */
+        bool walk(pson_handler& handler){
+            uint32_t field_number;
+            pb_wire_type wire_type;
+            if(!pb_decode_tag(wire_type, field_number)) return false;
+            if(wire_type==length_delimited){
+                uint32_t size = 0;
+                if(!pb_decode_varint32(size)) return false;
+                switch(field_number){
+                    case pson::string_field:
+                        return walk_payload(handler, string_payload, size);
+                    case pson::bytes_field:
+                        return walk_payload(handler, bytes_payload, size);
+                    case pson::object_field:
+                        return handler.start_object() && walk_object(handler, size) && handler.end_object();
+                    case pson::array_field:
+                        return handler.start_array() && walk_array(handler, size) && handler.end_array();
+                    default:
+                        return false;
+                }
+            }else{
+                switch(field_number){
+                    case pson::svarint_field:
+                    case pson::varint_field: {
+                        uint64_t magnitude;
+                        return pb_decode_varint64(magnitude) && handler.integer(magnitude, field_number==pson::svarint_field);
+                    }
+                    case pson::float_field: {
+                        float value;
+                        return read_input(&value, 4) && handler.single(value);
+                    }
+                    case pson::double_field: {
+                        double value;
+                        return read_input(&value, 8) && handler.real(value);
+                    }
+                    case pson::true_field:
+                    case pson::false_field:
+                        return handler.boolean(field_number==pson::true_field);
+                    case pson::zero_field:
+                    case pson::one_field:
+                        return handler.integer(field_number==pson::one_field ? 1 : 0, false);
+                    case pson::null_field:
+                        return handler.null();
+                    case pson::empty_string:
+                        return handler.string("", 0);
+                    case pson::empty_bytes:
+                        return handler.bytes((const uint8_t*) "", 0);
+                    case pson::empty:
+                        // unset values are reported as empty objects, as json_encoder writes them
+                        return handler.start_object() && handler.end_object();
+                    default:
+                        return false;
+                }
+            }
+        }
+
         bool decode(pson_object & object, size_t size){
+            if(sorted_keys_){
+                object.set_sorted_keys(true);
+            }
+            if(recycle_){
+                object.truncate(0);
+            }
             size_t start_read = bytes_read();
             while(size-(bytes_read()-start_read)>0){
-                pson_pair* pair = object.create_item();
+                pson_pair* pair = recycle_ ? object.recycle_item() : object.create_item();
                 if(pair==NULL || !decode(*pair)){
                     return false;
                 }
+                if(object.sorted_){
+                    object.sort_last();
+                }
             }
             return true;
         }
 
         bool decode(pson_array & array, size_t size){
+            if(recycle_){
+                array.truncate(0);
+            }
             size_t start_read = bytes_read();
             while(size-(bytes_read()-start_read)>0){
-                pson* item = array.create_item();
+                pson* item = recycle_ ? array.recycle_item() : array.create_item();
                 if(item==NULL || !decode(*item)){
                     return false;
                 }
@@ -881,39 +2777,64 @@ namespace protoson {
         bool decode(pson_pair & pair){
             uint32_t name_size;
             if(pb_decode_varint32(name_size)){
+                if(string_heap_!=NULL && name_size>=pson_pair::inline_name_size && name_size != UINT32_MAX){
+                    const char* name = pb_read_heap_string(name_size);
+                    if(name==NULL) return false;
+                    pair.set_name_ref(name, name_size);
+                    return decode(pair.value());
+                }
                 return name_size != UINT32_MAX && pair.allocate_name(name_size + 1) && pb_read_string(pair.name(), name_size) && decode(pair.value());
             }
             return false;
         }
 
         bool decode(pson& value) {
+            if(allocator_!=NULL && &value.get_allocator()!=allocator_ && !value.set_allocator(*allocator_)){
+                return false;
+            }
             uint32_t field_number;
             pb_wire_type wire_type;
             if(!pb_decode_tag(wire_type, field_number)) return false;
-            value.set_type((pson::field_type)field_number);
+            bool recycled = recycle_ && recyclable(value, (pson::field_type)field_number);
+            if(!recycled){
+                value.set_type((pson::field_type)field_number);
+            }
             if(wire_type==length_delimited){
                 uint32_t size = 0;
                 if(!pb_decode_varint32(size)) return false;
                 switch(field_number){
                     case pson::string_field:
-                        return size!=UINT32_MAX && value.allocate(size+1) && pb_read_string((char*)value.get_value(), size);
+                        // short strings are still copied, as they are stored inline in the node
+                        if(zero_copy_ && size>=pson::inline_size){
+                            if(const void* str = reference_input(size)){
+                                value.set_string_ref((const char*) str, size);
+                                return true;
+                            }
+                        }
+                        if(string_heap_!=NULL && size>=pson::inline_size){
+                            const char* str = pb_read_heap_string(size);
+                            if(str==NULL) return false;
+                            value.set_string_ref(str, size, true);
+                            return true;
+                        }
+                        return pb_read_string(value.allocate_string(size), size);
                     case pson::bytes_field: {
-                        uint8_t varint_size = value.get_varint_size(size);
-                        if(size<=UINT32_MAX-varint_size && value.allocate(size + varint_size)){
-                            if(read((char*)value.get_value() + varint_size, size)){
-                                value.pb_encode_varint(size);
+                        if(zero_copy_){
+                            if(const void* bytes = reference_input(size)){
+                                value.set_bytes_ref((const uint8_t*) bytes, size);
                                 return true;
                             }
                         }
-                        return false;
+                        uint8_t* bytes = value.allocate_bytes(size);
+                        return bytes!=NULL && read_input(bytes, size);
                     }
                     case pson::object_field:
-                        if(value.allocate<pson_object>()){
+                        if(recycled || value.allocate<pson_object>()){
                             return decode(*(pson_object*) value.get_value(), size);
                         }
                         return false;
                     case pson::array_field:
-                        if(value.allocate<pson_array>()){
+                        if(recycled || value.allocate<pson_array>()){
                             return decode(*(pson_array*) value.get_value(), size);
                         }
                     default:
@@ -925,9 +2846,9 @@ namespace protoson {
                     case pson::varint_field:
                         return pb_read_varint(value);
                     case pson::float_field:
-                        return value.allocate(4) && read(value.get_value(), 4);
+                        return read_input(value.get_value(), 4);
                     case pson::double_field:
-                        return value.allocate(8) && read(value.get_value(), 8);
+                        return read_input(value.get_value(), 8);
                     case pson::null_field:
                     case pson::true_field:
                     case pson::false_field:
@@ -1012,12 +2933,16 @@ namespace protoson {
 
         void pb_encode_string(const char* str){
             if(str!=NULL){
-                size_t string_size = strlen(str);
-                pb_encode_varint(string_size);
-                write(str, string_size);
+                pb_encode_bytes(str, strlen(str));
             }
         }
 
+        // length delimited payload: its size followed by its contents
+        void pb_encode_bytes(const void* bytes, size_t size){
+            pb_encode_varint(size);
+            write(bytes, size);
+        }
+
         template<class T>
         void pb_encode_submessage(T& element, uint32_t field_number)
         {
@@ -1067,23 +2992,32 @@ namespace protoson {
         }
 
         void encode(pson_pair & pair){
-            pb_encode_string(pair.name());
+            pb_encode_bytes(pair.name(), pair.name_size());
             encode(pair.value());
         }
 
         void encode(pson & value) {
             switch (value.get_type()) {
-                case pson::string_field:
-                    pb_encode_string((const char*)value.get_value(), pson::string_field);
+                case pson::string_field: {
+                    const char* str = NULL;
+                    size_t size = 0;
+                    value.get_string(str, size);
+                    pb_encode_tag(length_delimited, pson::string_field);
+                    pb_encode_bytes(str, size);
+                }
                     break;
-                case pson::bytes_field:
+                case pson::bytes_field: {
+                    uint8_t* bytes = NULL;
+                    size_t size = 0;
+                    value.get_bytes(bytes, size);
                     pb_encode_tag(length_delimited, pson::bytes_field);
-                    write(((const char *) value.get_value()) + pb_write_varint(value.get_value()), value.pb_decode_varint());
+                    pb_encode_bytes(bytes, size);
+                }
                     break;
                 case pson::svarint_field:
                 case pson::varint_field:
                     pb_encode_tag(varint, value.get_type());
-                    pb_write_varint(value.get_value());
+                    pb_encode_varint(*(uint64_t*) value.get_value());
                     break;
                 case pson::float_field:
                     pb_encode_fixed32(pson::float_field, value.get_value());
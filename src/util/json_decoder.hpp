@@ -26,8 +26,10 @@
 
 #include <stdexcept>
 #include <string>
+#include <vector>
 #include <cmath>
 #include "json.hpp"
+#include "json_parser.hpp"
 #include "../pson.h"
 
 namespace nlohmann
@@ -71,7 +73,7 @@ namespace nlohmann
 
             case detail::value_t::string:
             {
-                p = j.get<std::string>();
+                p = j.get_ref<const std::string&>();
                 break;
             }
 
@@ -91,7 +93,7 @@ namespace nlohmann
                 protoson::pson_object& object = (protoson::pson_object&) p;
                 // append each element
                 for (json::const_iterator it = j.begin(); it != j.end(); ++it) {
-                    to_pson_internal(it.value(), object[it.key().c_str()]);
+                    to_pson_internal(it.value(), object[it.key()]);
                 }
                 break;
             }
@@ -146,7 +148,12 @@ namespace nlohmann
             }
                 break;
             case protoson::pson::string_field:
-                j = (const char*) p;
+            {
+                const char* str = NULL;
+                size_t size = 0;
+                p.get_string(str, size);
+                j = std::string(str, size);
+            }
                 break;
             case protoson::pson::empty_string:
             case protoson::pson::empty_bytes:
@@ -155,9 +162,9 @@ namespace nlohmann
             case protoson::pson::object_field:
             {
                 j = json::object();
-                protoson::pson_container<protoson::pson_pair>::iterator it = ((protoson::pson_object&)p).begin();
+                protoson::pson_container<protoson::pson_pair>::iterator it = ((protoson::pson_object*) p.get_value())->begin();
                 while(it.valid()){
-                    to_json_internal(it.item().value(), j[it.item().name()]);
+                    to_json_internal(it.item().value(), j[std::string(it.item().name(), it.item().name_size())]);
                     it.next();
                 }
             }
@@ -165,7 +172,7 @@ namespace nlohmann
             case protoson::pson::array_field:
             {
                 j = json::array();
-                protoson::pson_container<protoson::pson>::iterator it = ((protoson::pson_array&)p).begin();
+                protoson::pson_container<protoson::pson>::iterator it = ((protoson::pson_array*) p.get_value())->begin();
                 while(it.valid()){
                     json array_value;
                     to_json_internal(it.item(), array_value);
@@ -206,6 +213,117 @@ namespace nlohmann
 }
 
 namespace protoson{
+
+    /*
+     * Builds pson values from the events of nlohmann::json::sax_parse, without a nlohmann::json
+     * document in between. The result is the same as parsing a document and converting it with
+     * to_pson: numbers keep the integer, unsigned and float distinctions, and objects have their
+     * keys sorted and unique (the last duplicated key wins), as nlohmann::json stores them.
+     */
+    class json_sax_decoder : public nlohmann::json::json_sax_t {
+    private:
+        pson& root_;
+        // open objects and arrays
+        std::vector<pson*> containers_;
+        // value of the last key read in the current object
+        pson* key_value_;
+
+        // the value to be set by the current event
+        pson* next_value(){
+            if(containers_.empty()) return &root_;
+            pson* container = containers_.back();
+            if(container->is_array()){
+                return ((pson_array*) container->get_value())->create_item();
+            }
+            return key_value_;
+        }
+
+        template<class T>
+        bool set(T value){
+            pson* destination = next_value();
+            if(destination==NULL) return false;
+            *destination = value;
+            return true;
+        }
+
+    public:
+        explicit json_sax_decoder(pson& root) : root_(root), key_value_(NULL) {
+            root_.set_type(pson::empty);
+        }
+
+        virtual bool null(){
+            pson* destination = next_value();
+            if(destination==NULL) return false;
+            destination->set_null();
+            return true;
+        }
+
+        virtual bool boolean(bool value){
+            return set(value);
+        }
+
+        virtual bool number_integer(number_integer_t value){
+            return set((std::int64_t) value);
+        }
+
+        virtual bool number_unsigned(number_unsigned_t value){
+            return set((std::uint64_t) value);
+        }
+
+        virtual bool number_float(number_float_t value, const string_t&){
+            return set((double) value);
+        }
+
+        virtual bool string(string_t& value){
+            pson* destination = next_value();
+            if(destination==NULL) return false;
+            destination->set_string(value.data(), value.size());
+            return true;
+        }
+
+        virtual bool start_object(std::size_t){
+            pson* destination = next_value();
+            if(destination==NULL) return false;
+            // sorted while it is built, so repeated keys are found with a binary search
+            static_cast<pson_object&>(*destination).set_sorted_keys(true);
+            if(!destination->is_object()) return false;
+            containers_.push_back(destination);
+            return true;
+        }
+
+        virtual bool key(string_t& name){
+            pson_object& object = *containers_.back();
+            key_value_ = &object.get(name.data(), name.size());
+            key_value_->set_type(pson::empty);
+            return true;
+        }
+
+        virtual bool end_object(){
+            static_cast<pson_object&>(*containers_.back()).set_sorted_keys(false);
+            containers_.pop_back();
+            return true;
+        }
+
+        virtual bool start_array(std::size_t){
+            pson* destination = next_value();
+            if(destination==NULL) return false;
+            // the conversion turns the destination into an empty array
+            (void) static_cast<pson_array&>(*destination);
+            if(!destination->is_array()) return false;
+            containers_.push_back(destination);
+            return true;
+        }
+
+        virtual bool end_array(){
+            containers_.pop_back();
+            return true;
+        }
+
+        virtual bool parse_error(std::size_t, const std::string&, const nlohmann::detail::exception&){
+            return false;
+        }
+    };
+
     class json_decoder{
     public:
         static bool parse(const std::string& json, pson& pson){
@@ -218,6 +336,25 @@ namespace protoson{
             return true;
         }
 
+        /*
+         * Parses with json_parser, straight into pson and without nlohmann::json. Unlike parse(), keys
+         * keep their document order and duplicated keys are all kept, so lookups find the first one.
+         */
+        static bool parse_native(const std::string& json, pson& pson){
+            json_parser parser;
+            return parser.parse(json.data(), json.size(), pson);
+        }
+
+        // parses with nlohmann::json::sax_parse, giving the same result as to_pson without its document
+        static bool parse_sax(const std::string& json, pson& pson){
+            json_sax_decoder decoder(pson);
+            try{
+                return nlohmann::json::sax_parse(json, &decoder);
+            }catch(...){
+                return false;
+            }
+        }
+
         static bool parse(const nlohmann::json& json, pson& pson){
             try{
                 nlohmann::to_pson(json, pson);
@@ -25,7 +25,6 @@
 #define JSON_ENCODER_HPP
 
 #include <sstream>
-#include <numeric>
 #include <cmath>
 #include "../pson.h"
 
@@ -41,144 +40,12 @@ namespace protoson {
 
     public:
 
-        static std::size_t extra_space(const std::string& s) noexcept
-        {
-            return std::accumulate(s.begin(), s.end(), size_t{},
-               [](size_t res, typename std::string::value_type c)
-               {
-                   switch (c)
-                   {
-                       case '"':
-                       case '\\':
-                       case '\b':
-                       case '\f':
-                       case '\n':
-                       case '\r':
-                       case '\t':
-                       {
-                           // from c (1 byte) to \x (2 bytes)
-                           return res + 1;
-                       }
-
-                       default:
-                       {
-                           if (c >= 0x00 and c <= 0x1f)
-                           {
-                               // from c (1 byte) to \uxxxx (6 bytes)
-                               return res + 5;
-                           }
-
-                           return res;
-                       }
-                   }
-               });
-        }
-
+        // escapes a string for a JSON document, without the quotes
         static std::string escape_string(const std::string& s)
         {
-            const auto space = extra_space(s);
-            if (space == 0)
-            {
-                return s;
-            }
-
-            // create a result string of necessary size
-            std::string result(s.size() + space, '\\');
-            std::size_t pos = 0;
-
-            for (const auto& c : s)
-            {
-                switch (c)
-                {
-                    // quotation mark (0x22)
-                    case '"':
-                    {
-                        result[pos + 1] = '"';
-                        pos += 2;
-                        break;
-                    }
-
-                        // reverse solidus (0x5c)
-                    case '\\':
-                    {
-                        // nothing to change
-                        pos += 2;
-                        break;
-                    }
-
-                        // backspace (0x08)
-                    case '\b':
-                    {
-                        result[pos + 1] = 'b';
-                        pos += 2;
-                        break;
-                    }
-
-                        // formfeed (0x0c)
-                    case '\f':
-                    {
-                        result[pos + 1] = 'f';
-                        pos += 2;
-                        break;
-                    }
-
-                        // newline (0x0a)
-                    case '\n':
-                    {
-                        result[pos + 1] = 'n';
-                        pos += 2;
-                        break;
-                    }
-
-                        // carriage return (0x0d)
-                    case '\r':
-                    {
-                        result[pos + 1] = 'r';
-                        pos += 2;
-                        break;
-                    }
-
-                        // horizontal tab (0x09)
-                    case '\t':
-                    {
-                        result[pos + 1] = 't';
-                        pos += 2;
-                        break;
-                    }
-
-                    default:
-                    {
-                        if (c >= 0x00 and c <= 0x1f)
-                        {
-                            // convert a number 0..15 to its hex representation
-                            // (0..f)
-                            static const char hexify[16] =
-                                    {
-                                            '0', '1', '2', '3', '4', '5', '6', '7',
-                                            '8', '9', 'a', 'b', 'c', 'd', 'e', 'f'
-                                    };
-
-                            // print character c as \uxxxx
-                            for (const char m :
-                                    { 'u', '0', '0', hexify[c >> 4], hexify[c & 0x0f]
-                                    })
-                            {
-                                result[++pos] = m;
-                            }
-
-                            ++pos;
-                        }
-                        else
-                        {
-                            // all other characters are added as-is
-                            result[pos++] = c;
-                        }
-                        break;
-                    }
-                }
-            }
-
-            return result;
+            std::ostringstream result;
+            write_escaped(result, s.data(), s.size());
+            return result.str();
         }
 
         template<class T>
@@ -192,12 +59,54 @@ namespace protoson {
 
         void encode(const char* value, bool quoted = false){
             if(quoted){
-                stream_ << '"' << escape_string(value) << '"';
+                encode_string(value, strlen(value));
             }else{
                 stream_ << value;
             }
         }
 
+        // writes a quoted and escaped string of the given size, without copying it
+        void encode_string(const char* value, size_t size){
+            stream_ << '"';
+            write_escaped(stream_, value, size);
+            stream_ << '"';
+        }
+
+        // writes the runs of plain characters as they are, and escapes the characters between them
+        static void write_escaped(std::ostream& stream, const char* value, size_t size){
+            static const char hexify[16] =
+                    {
+                            '0', '1', '2', '3', '4', '5', '6', '7',
+                            '8', '9', 'a', 'b', 'c', 'd', 'e', 'f'
+                    };
+            size_t start = 0;
+            for(size_t i=0; i<size; i++){
+                unsigned char c = value[i];
+                char escape = 0;
+                switch(c){
+                    case '"':  escape = '"';  break;
+                    case '\\': escape = '\\'; break;
+                    case '\b': escape = 'b';  break;
+                    case '\f': escape = 'f';  break;
+                    case '\n': escape = 'n';  break;
+                    case '\r': escape = 'r';  break;
+                    case '\t': escape = 't';  break;
+                    default:
+                        if(c > 0x1f) continue;
+                        break;
+                }
+                stream.write(value + start, i - start);
+                start = i + 1;
+                if(escape){
+                    stream << '\\' << escape;
+                }else{
+                    // print character c as \uxxxx
+                    stream << "\\u00" << hexify[c >> 4] << hexify[c & 0x0f];
+                }
+            }
+            stream.write(value + start, size - start);
+        }
+
         void encode(pson_object & object){
             encode('{');
             pson_container<pson_pair>::iterator it = object.begin();
@@ -225,11 +134,7 @@ namespace protoson {
         }
 
         void encode(pson_pair & pair){
-            if(pair.name()!=NULL){
-                encode(pair.name(), true);
-            }else{
-                encode("");
-            }
+            encode_string(pair.name(), pair.name_size());
             encode(':');
             encode(pair.value());
         }
@@ -277,17 +182,26 @@ namespace protoson {
                 }
                     break;
                 case pson::string_field:
-                    encode((const char*)value, !root);
+                {
+                    const char* str = NULL;
+                    size_t size = 0;
+                    value.get_string(str, size);
+                    if(root){
+                        stream_.write(str, size);
+                    }else{
+                        encode_string(str, size);
+                    }
+                }
                     break;
                 case pson::empty_string:
                 case pson::empty_bytes:
                     encode("", !root);
                     break;
                 case pson::object_field:
-                    encode((pson_object &)value);
+                    encode(*(pson_object *) value.get_value());
                     break;
                 case pson::array_field:
-                    encode((pson_array &)value);
+                    encode(*(pson_array *) value.get_value());
                     break;
                 case pson::bytes_field:
                     if(!root){ // binary fields are not supported inside a JSON tree
@@ -0,0 +1,379 @@
+// The MIT License (MIT)
+//
+// Copyright (c) 2017 THINK BIG LABS S.L.
+// Author: alvarolb@gmail.com (Alvaro Luis Bustamante)
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#ifndef JSON_PARSER_HPP
+#define JSON_PARSER_HPP
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../pson.h"
+
+namespace protoson {
+
+    /*
+     * JSON parser that builds pson values straight from the text, without an intermediate DOM, so
+     * every node, key and string is allocated once, from the allocator of the destination value.
+     * Keys keep their document order, including duplicated keys. Strings are unescaped, but their
+     * UTF-8 is not validated. Numbers are stored as integers when they fit in 64 bits (with either
+     * sign), and as floating point otherwise. Numbers out of the double range are rejected. Real
+     * numbers are converted with strtod, so LC_NUMERIC must use '.' as decimal separator (the "C"
+     * locale, which is the default); other locales make the parse fail instead of truncating numbers.
+     */
+    class json_parser {
+    private:
+        const char* json_;
+        size_t size_;
+        size_t position_;
+        size_t depth_;
+        size_t max_depth_;
+
+        void skip_whitespace(){
+            while(position_<size_){
+                switch(json_[position_]){
+                    case ' ':
+                    case '\t':
+                    case '\n':
+                    case '\r':
+                        position_++;
+                        break;
+                    default:
+                        return;
+                }
+            }
+        }
+
+        bool consume(char c){
+            skip_whitespace();
+            if(position_<size_ && json_[position_]==c){
+                position_++;
+                return true;
+            }
+            return false;
+        }
+
+        bool parse_literal(const char* literal, size_t size){
+            if(size_-position_<size || memcmp(json_ + position_, literal, size)!=0) return false;
+            position_ += size;
+            return true;
+        }
+
+        bool read_hex(size_t position, uint32_t& code) const{
+            if(size_-position<4) return false;
+            code = 0;
+            for(size_t i=position; i<position+4; i++){
+                char c = json_[i];
+                code <<= 4;
+                if(c>='0' && c<='9') code |= c - '0';
+                else if(c>='a' && c<='f') code |= c - 'a' + 10;
+                else if(c>='A' && c<='F') code |= c - 'A' + 10;
+                else return false;
+            }
+            return true;
+        }
+
+        // read the \uXXXX escape at position (and its low surrogate), returning its length in the text
+        size_t read_code_point(size_t position, uint32_t& code) const{
+            if(!read_hex(position + 2, code)) return 0;
+            if(code>=0xDC00 && code<=0xDFFF) return 0;
+            if(code<0xD800 || code>0xDBFF) return 6;
+            uint32_t low;
+            if(size_-position<12 || json_[position+6]!='\\' || json_[position+7]!='u' ||
+               !read_hex(position + 8, low) || low<0xDC00 || low>0xDFFF) return 0;
+            code = 0x10000 + ((code - 0xD800) << 10) + (low - 0xDC00);
+            return 12;
+        }
+
+        static size_t utf8_size(uint32_t code){
+            return code<0x80 ? 1 : code<0x800 ? 2 : code<0x10000 ? 3 : 4;
+        }
+
+        static char* write_utf8(char* str, uint32_t code){
+            if(code<0x80){
+                *str++ = (char) code;
+            }else if(code<0x800){
+                *str++ = (char) (0xC0 | (code >> 6));
+                *str++ = (char) (0x80 | (code & 0x3F));
+            }else if(code<0x10000){
+                *str++ = (char) (0xE0 | (code >> 12));
+                *str++ = (char) (0x80 | ((code >> 6) & 0x3F));
+                *str++ = (char) (0x80 | (code & 0x3F));
+            }else{
+                *str++ = (char) (0xF0 | (code >> 18));
+                *str++ = (char) (0x80 | ((code >> 12) & 0x3F));
+                *str++ = (char) (0x80 | ((code >> 6) & 0x3F));
+                *str++ = (char) (0x80 | (code & 0x3F));
+            }
+            return str;
+        }
+
+        /*
+         * Validate the string that starts at the current position (after its opening quote), finding
+         * its closing quote and its size once unescaped.
+         */
+        bool scan_string(size_t& end, size_t& size, bool& escaped){
+            size = 0;
+            escaped = false;
+            size_t position = position_;
+            while(position<size_){
+                unsigned char c = json_[position];
+                if(c=='"'){
+                    end = position;
+                    return true;
+                }
+                if(c<0x20) return false;
+                if(c!='\\'){
+                    position++;
+                    size++;
+                    continue;
+                }
+                escaped = true;
+                if(position+1>=size_) return false;
+                switch(json_[position+1]){
+                    case '"':
+                    case '\\':
+                    case '/':
+                    case 'b':
+                    case 'f':
+                    case 'n':
+                    case 'r':
+                    case 't':
+                        position += 2;
+                        size++;
+                        break;
+                    case 'u': {
+                        uint32_t code;
+                        size_t length = read_code_point(position, code);
+                        if(length==0) return false;
+                        position += length;
+                        size += utf8_size(code);
+                        break;
+                    }
+                    default:
+                        return false;
+                }
+            }
+            return false;
+        }
+
+        // copy the scanned string into str, replacing its escape sequences
+        void unescape(char* str, size_t end){
+            while(position_<end){
+                char c = json_[position_];
+                if(c!='\\'){
+                    *str++ = c;
+                    position_++;
+                    continue;
+                }
+                switch(json_[position_+1]){
+                    case 'b': *str++ = '\b'; break;
+                    case 'f': *str++ = '\f'; break;
+                    case 'n': *str++ = '\n'; break;
+                    case 'r': *str++ = '\r'; break;
+                    case 't': *str++ = '\t'; break;
+                    case 'u': {
+                        uint32_t code;
+                        size_t length = read_code_point(position_, code);
+                        str = write_utf8(str, code);
+                        position_ += length;
+                        continue;
+                    }
+                    default: *str++ = json_[position_+1]; break;
+                }
+                position_ += 2;
+            }
+        }
+
+        // read a string into the room returned by allocate(size + 1)
+        template<class F>
+        bool parse_string(F allocate){
+            if(!consume('"')) return false;
+            size_t end, size;
+            bool escaped;
+            if(!scan_string(end, size, escaped)) return false;
+            char* str = allocate(size);
+            if(str==NULL) return false;
+            if(escaped){
+                unescape(str, end);
+            }else{
+                memcpy(str, json_ + position_, size);
+            }
+            str[size] = 0;
+            position_ = end + 1;
+            return true;
+        }
+
+        bool parse_number(pson& value){
+            size_t start = position_;
+            bool negative = position_<size_ && json_[position_]=='-';
+            if(negative) position_++;
+            if(position_>=size_ || json_[position_]<'0' || json_[position_]>'9') return false;
+            // integer part, without leading zeros
+            uint64_t magnitude = 0;
+            bool overflow = false;
+            if(json_[position_]=='0'){
+                position_++;
+            }else{
+                while(position_<size_ && json_[position_]>='0' && json_[position_]<='9'){
+                    uint64_t digit = json_[position_++] - '0';
+                    if(magnitude > (UINT64_MAX - digit) / 10) overflow = true;
+                    magnitude = magnitude * 10 + digit;
+                }
+            }
+            bool real = overflow;
+            if(position_<size_ && json_[position_]=='.'){
+                position_++;
+                size_t digits = position_;
+                while(position_<size_ && json_[position_]>='0' && json_[position_]<='9') position_++;
+                if(position_==digits) return false;
+                real = true;
+            }
+            if(position_<size_ && (json_[position_]=='e' || json_[position_]=='E')){
+                position_++;
+                if(position_<size_ && (json_[position_]=='+' || json_[position_]=='-')) position_++;
+                size_t digits = position_;
+                while(position_<size_ && json_[position_]>='0' && json_[position_]<='9') position_++;
+                if(position_==digits) return false;
+                real = true;
+            }
+            if(!real){
+                value.set_integer(magnitude, negative);
+                return true;
+            }
+            // strtod needs a terminated copy, as the text may continue (or end) right after the number
+            char buffer[64];
+            size_t size = position_ - start;
+            char* number = size<sizeof(buffer) ? buffer : (char*) value.get_allocator().allocate(size + 1);
+            if(number==NULL) return false;
+            memcpy(number, json_ + start, size);
+            number[size] = 0;
+            char* end = NULL;
+            double real_value = strtod(number, &end);
+            bool converted = end==number + size;
+            if(number!=buffer){
+                value.get_allocator().deallocate(number, size + 1);
+            }
+            // overflows are infinite, which json cannot represent
+            if(!converted || isinf(real_value)) return false;
+            value = real_value;
+            return true;
+        }
+
+        bool parse_object(pson& value){
+            pson_object& object = value;
+            if(consume('}')) return true;
+            do{
+                pson_pair* pair = object.create_item();
+                if(pair==NULL) return false;
+                if(!parse_string([pair](size_t size){ return pair->allocate_name(size + 1); })) return false;
+                if(!consume(':') || !parse_value(pair->value())) return false;
+            }while(consume(','));
+            return consume('}');
+        }
+
+        bool parse_array(pson& value){
+            pson_array& array = value;
+            if(consume(']')) return true;
+            do{
+                pson* item = array.create_item();
+                if(item==NULL || !parse_value(*item)) return false;
+            }while(consume(','));
+            return consume(']');
+        }
+
+        bool parse_value(pson& value){
+            skip_whitespace();
+            if(position_>=size_) return false;
+            switch(json_[position_]){
+                case '{':
+                case '[': {
+                    if(depth_==max_depth_) return false;
+                    depth_++;
+                    bool object = json_[position_++]=='{';
+                    bool result = object ? parse_object(value) : parse_array(value);
+                    depth_--;
+                    return result;
+                }
+                case '"': {
+                    // empty strings have no room, so their terminator is written aside
+                    char empty[1];
+                    return parse_string([&value, &empty](size_t size) -> char* {
+                        if(size==0){
+                            value = "";
+                            return empty;
+                        }
+                        return value.allocate_string(size);
+                    });
+                }
+                case 't':
+                    if(!parse_literal("true", 4)) return false;
+                    value = true;
+                    return true;
+                case 'f':
+                    if(!parse_literal("false", 5)) return false;
+                    value = false;
+                    return true;
+                case 'n':
+                    if(!parse_literal("null", 4)) return false;
+                    value.set_null();
+                    return true;
+                default:
+                    return parse_number(value);
+            }
+        }
+
+    public:
+        json_parser() : json_(NULL), size_(0), position_(0), depth_(0), max_depth_(256) {
+        }
+
+        // maximum nesting of objects and arrays, which bounds the stack used by the parser
+        void set_max_depth(size_t max_depth){
+            max_depth_ = max_depth;
+        }
+
+        // parse a JSON document of the given size, replacing the contents of value
+        bool parse(const char* json, size_t size, pson& value){
+            json_ = json;
+            size_ = size;
+            position_ = 0;
+            depth_ = 0;
+            value.set_type(pson::empty);
+            if(!parse_value(value)) return false;
+            skip_whitespace();
+            return position_==size_;
+        }
+
+        bool parse(const char* json, pson& value){
+            return parse(json, strlen(json), value);
+        }
+
+        // where parsing stopped, i.e., the offset of the error if parsing failed
+        size_t position() const{
+            return position_;
+        }
+    };
+
+}
+
+#endif
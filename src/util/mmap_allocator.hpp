@@ -0,0 +1,148 @@
+// The MIT License (MIT)
+//
+// Copyright (c) 2017 THINK BIG LABS S.L.
+// Author: alvarolb@gmail.com (Alvaro Luis Bustamante)
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#ifndef MMAP_ALLOCATOR_HPP
+#define MMAP_ALLOCATOR_HPP
+
+#include <sys/mman.h>
+#include <unistd.h>
+#include "../pson.h"
+
+namespace protoson {
+
+    /*
+     * Monotonic allocator for bulk conversions of large documents (POSIX only). Nodes are bump
+     * allocated from large anonymous mmap regions instead of millions of small mallocs, optionally
+     * backed by transparent huge pages to reduce TLB misses. Like arena_memory_allocator, memory is
+     * not released by deallocate(), but all at once by reset() or when the allocator is destroyed.
+     */
+    class mmap_memory_allocator : public memory_allocator{
+    private:
+        struct region{
+            region* next;
+            size_t size;
+        };
+
+        enum {
+            header_size = align(sizeof(region))
+        };
+
+        region* regions_;
+        size_t region_size_;
+        size_t index_;
+        bool huge_pages_;
+
+        bool add_region(size_t size){
+            size_t page = (size_t) sysconf(_SC_PAGESIZE);
+            size = (header_size + size + page - 1) / page * page;
+            void* memory = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+            if(memory==MAP_FAILED) return false;
+#ifdef MADV_HUGEPAGE
+            if(huge_pages_){
+                madvise(memory, size, MADV_HUGEPAGE);
+            }
+#endif
+            region* new_region = (region*) memory;
+            new_region->next = regions_;
+            new_region->size = size - header_size;
+            regions_ = new_region;
+            index_ = 0;
+            return true;
+        }
+
+        static void unmap(region* current){
+            munmap(current, header_size + current->size);
+        }
+
+    public:
+        /*
+         * Regions are reserved (but only backed by memory when touched) in multiples of region_size.
+         * Huge pages are only a hint to the kernel, and ignored where not supported.
+         */
+        explicit mmap_memory_allocator(size_t region_size = 64 << 20, bool huge_pages = false) :
+                regions_(NULL), region_size_(region_size), index_(0), huge_pages_(huge_pages) {
+        }
+
+        mmap_memory_allocator(const mmap_memory_allocator&) = delete;
+        mmap_memory_allocator& operator=(const mmap_memory_allocator&) = delete;
+
+        ~mmap_memory_allocator(){
+            release();
+        }
+
+        virtual void *allocate(size_t size) {
+            size = align(size);
+            if(regions_==NULL || index_ + size > regions_->size){
+                if(!add_region(size > region_size_ ? size : region_size_)) return NULL;
+            }
+            void* position = (uint8_t*) regions_ + header_size + index_;
+            index_ += size;
+            return position;
+        }
+
+        virtual void deallocate(void *) {}
+
+        virtual bool trivial_deallocate() const{
+            return true;
+        }
+
+        // discard every allocation, keeping the current region (its pages are returned to the system)
+        void reset(){
+            if(regions_==NULL) return;
+            region* current = regions_->next;
+            while(current!=NULL){
+                region* next = current->next;
+                unmap(current);
+                current = next;
+            }
+            regions_->next = NULL;
+            size_t page = (size_t) sysconf(_SC_PAGESIZE);
+            size_t used = (header_size + index_ + page - 1) / page * page;
+            if(used > page){
+                madvise((uint8_t*) regions_ + page, used - page, MADV_DONTNEED);
+            }
+            index_ = 0;
+        }
+
+        // discard every allocation and unmap all the regions
+        void release(){
+            while(regions_!=NULL){
+                region* next = regions_->next;
+                unmap(regions_);
+                regions_ = next;
+            }
+            index_ = 0;
+        }
+
+        // bytes reserved in mapped regions
+        size_t capacity() const{
+            size_t capacity = 0;
+            for(region* current = regions_; current!=NULL; current=current->next){
+                capacity += current->size;
+            }
+            return capacity;
+        }
+    };
+}
+
+#endif
@@ -0,0 +1,129 @@
+// The MIT License (MIT)
+//
+// Copyright (c) 2017 THINK BIG LABS S.L.
+// Author: alvarolb@gmail.com (Alvaro Luis Bustamante)
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#ifndef PMR_ALLOCATOR_HPP
+#define PMR_ALLOCATOR_HPP
+
+#if __cplusplus < 201703L || !__has_include(<memory_resource>)
+#error "pmr_allocator.hpp requires C++17 and <memory_resource>"
+#endif
+
+#include <cstdint>
+#include <memory_resource>
+#include <new>
+#include "../pson.h"
+
+namespace protoson {
+
+    /*
+     * Allocator backed by a std::pmr::memory_resource, so pson trees can live in the same arena as the
+     * rest of a request (monotonic_buffer_resource, unsynchronized_pool_resource, ...). The library
+     * always releases blocks with their size, as memory resources require. Blocks released without
+     * their size are left to the resource, which reclaims them when it is released or destroyed.
+     */
+    class pmr_memory_allocator : public memory_allocator{
+    private:
+        std::pmr::memory_resource* resource_;
+        bool monotonic_;
+
+    public:
+        explicit pmr_memory_allocator(std::pmr::memory_resource* resource = std::pmr::get_default_resource()) :
+            resource_(resource),
+            monotonic_(dynamic_cast<std::pmr::monotonic_buffer_resource*>(resource)!=NULL) {
+        }
+
+        virtual void *allocate(size_t size) {
+            try{
+                return resource_->allocate(size>0 ? size : 1, alignment);
+            }catch(const std::bad_alloc&){
+                return NULL;
+            }
+        }
+
+        virtual void deallocate(void *) {}
+
+        virtual void deallocate(void * ptr, size_t size) {
+            if(ptr!=NULL){
+                resource_->deallocate(ptr, size>0 ? size : 1, alignment);
+            }
+        }
+
+        // a monotonic buffer frees nothing until it is released, so trees are discarded without walking them
+        virtual bool trivial_deallocate() const{
+            return monotonic_;
+        }
+
+        std::pmr::memory_resource* resource() const{
+            return resource_;
+        }
+    };
+
+    /*
+     * Memory resource that serves std::pmr containers from a protoson allocator, for example to keep
+     * them in the same arena as a pson tree. Alignments above the one guaranteed by protoson allocators
+     * are obtained by over-allocating. Exhaustion is reported with std::bad_alloc.
+     */
+    class memory_allocator_resource : public std::pmr::memory_resource{
+    private:
+        memory_allocator& allocator_;
+
+    public:
+        explicit memory_allocator_resource(memory_allocator& allocator) : allocator_(allocator) {
+        }
+
+        memory_allocator& allocator() const{
+            return allocator_;
+        }
+
+    protected:
+        virtual void* do_allocate(size_t bytes, size_t align) {
+            if(align<=memory_allocator::alignment){
+                if(void* memory = allocator_.allocate(bytes)) return memory;
+                throw std::bad_alloc();
+            }
+            // keep the original block just before the aligned one (there are at least alignment bytes free)
+            uint8_t* memory = (uint8_t*) allocator_.allocate(bytes + align);
+            if(memory==NULL) throw std::bad_alloc();
+            uint8_t* aligned = (uint8_t*) (((uintptr_t) memory + align) & ~(uintptr_t)(align - 1));
+            ((void**) aligned)[-1] = memory;
+            return aligned;
+        }
+
+        virtual void do_deallocate(void* ptr, size_t bytes, size_t align) {
+            if(align<=memory_allocator::alignment){
+                allocator_.deallocate(ptr, bytes);
+            }else{
+                allocator_.deallocate(((void**) ptr)[-1], bytes + align);
+            }
+        }
+
+        virtual bool do_is_equal(const std::pmr::memory_resource& other) const noexcept {
+            if(this==&other) return true;
+            const memory_allocator_resource* resource = dynamic_cast<const memory_allocator_resource*>(&other);
+            return resource!=NULL && &resource->allocator_==&allocator_;
+        }
+    };
+
+}
+
+#endif
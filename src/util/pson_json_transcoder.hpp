@@ -27,143 +27,124 @@
 #include <stdint.h>
 #include <stddef.h>
 #include <sstream>
+#include <cmath>
 #include "../pson.h"
+#include "json_encoder.hpp"
 
 namespace protoson {
 
-    class pson_json_transcoder : public pson_decoder {
+    // writes encoded PSON as JSON text while walking it, with the same output as json_encoder
+    class pson_json_transcoder : public pson_decoder, public pson_handler {
 
     private:
         std::ostream& stream_;
+        json_encoder encoder_;
+        // a value was written at the current level, so the next one needs a separator
+        bool separate_;
 
-    public:
-        pson_json_transcoder(std::ostream& stream) : stream_(stream){
+        void separate(){
+            if(separate_){
+                stream_ << ',';
+                separate_ = false;
+            }
         }
 
-    protected:
         template<class T>
-        void encode(T value){
-            stream_ << value;
+        bool encode_real(T value){
+            separate();
+            if(std::isnan(value)){
+                stream_ << "null";
+            }else{
+                stream_ << value;
+            }
+            separate_ = true;
+            return true;
         }
 
     public:
+        pson_json_transcoder(std::ostream& stream) : stream_(stream), encoder_(stream), separate_(false){
+        }
 
-        bool transcode_object(size_t size){
-            encode('{');
-            size_t start_read = bytes_read();
-            while(size-(bytes_read()-start_read)>0){
-                if(!transcode_pair()){
-                    return false;
-                }
-                if(size-(bytes_read()-start_read)>0){
-                    encode(',');
-                }
-            }
-            encode('}');
+        bool transcode_value() {
+            separate_ = false;
+            return walk(*this);
+        }
+
+        virtual bool null(){
+            separate();
+            stream_ << "null";
+            separate_ = true;
             return true;
         }
 
-        bool transcode_array(size_t size){
-            encode('[');
-            size_t start_read = bytes_read();
-            while(size-(bytes_read()-start_read)>0){
-                if(!transcode_value()){
-                    return false;
-                }
-                if(size-(bytes_read()-start_read)>0){
-                    encode(',');
-                }
-            }
-            encode(']');
+        virtual bool boolean(bool value){
+            separate();
+            stream_ << (value ? "true" : "false");
+            separate_ = true;
             return true;
         }
 
-        bool transcode_string(size_t size){
-            encode('"');
-            char byte;
-            for(size_t i=0; i<size; i++){
-                if(!read(&byte, 1)) return false;
-                encode(byte);
+        virtual bool integer(uint64_t magnitude, bool negative){
+            separate();
+            if(negative){
+                stream_ << '-';
             }
-            encode('"');
+            stream_ << magnitude;
+            separate_ = true;
             return true;
         }
 
-        bool transcode_pair(){
-            uint32_t name_size = 0;
-            if(!pb_decode_varint32(name_size)) return false;
-            if(!transcode_string(name_size)) return false;
-            encode(":");
-            if(!transcode_value()) return false;
+        virtual bool real(double value){
+            return encode_real(value);
+        }
+
+        virtual bool single(float value){
+            return encode_real(value);
+        }
+
+        virtual bool string(const char* str, size_t size){
+            separate();
+            encoder_.encode_string(str, size);
+            separate_ = true;
             return true;
         }
 
-        bool transcode_value() {
-            uint32_t field_number;
-            pb_wire_type wire_type;
-            pb_decode_tag(wire_type, field_number);
-            if(wire_type==pb_wire_type::length_delimited){
-                uint32_t size = 0;
-                if(!pb_decode_varint32(size)) return false;
-                switch(field_number) {
-                    case pson::string_field:
-                        return transcode_string(size);
-                    case pson::object_field:
-                        return transcode_object(size);
-                    case pson::array_field:
-                        return transcode_array(size);
-                }
-            }else {
-                switch (field_number) {
-                    case pson::true_field:
-                        encode("true");
-                        break;
-                    case pson::false_field:
-                        encode("false");
-                        break;
-                    case pson::one_field:
-                        encode("1");
-                        break;
-                    case pson::zero_field:
-                        encode("0");
-                        break;
-                    case pson::svarint_field:
-                    {
-                        uint64_t varint = 0;
-                        if(!pb_decode_varint64(varint)) return false;
-                        encode(-varint);
-                    }
-                        break;
-                    case pson::varint_field:
-                    {
-                        uint64_t varint = 0;
-                        if(!pb_decode_varint64(varint)) return false;
-                        encode(varint);
-                    }
-                        break;
-                    case pson::float_field: {
-                        float value;
-                        if(!read(&value, 4)) return false;
-                        encode(value);
-                    }
-                        break;
-                    case pson::double_field: {
-                        double value;
-                        if(!read(&value, 8)) return false;
-                        encode(value);
-                    }
-                    case pson::empty_bytes:
-                    case pson::empty_string:
-                        encode("\"\"");
-                        break;
-                    case pson::null_field:
-                        encode("null");
-                        break;
-                }
-            }
+        // binary fields are not supported inside a JSON tree
+        virtual bool bytes(const uint8_t*, size_t){
+            return string("", 0);
+        }
+
+        virtual bool start_object(){
+            separate();
+            stream_ << '{';
+            return true;
+        }
+
+        virtual bool key(const char* name, size_t size){
+            separate();
+            encoder_.encode_string(name, size);
+            stream_ << ':';
+            return true;
+        }
+
+        virtual bool end_object(){
+            stream_ << '}';
+            separate_ = true;
+            return true;
+        }
+
+        virtual bool start_array(){
+            separate();
+            stream_ << '[';
+            return true;
+        }
+
+        virtual bool end_array(){
+            stream_ << ']';
+            separate_ = true;
             return true;
         }
     };
 }
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,194 @@
+// The MIT License (MIT)
+//
+// Copyright (c) 2017 THINK BIG LABS S.L.
+// Author: alvarolb@gmail.com (Alvaro Luis Bustamante)
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#ifndef THREAD_CACHING_ALLOCATOR_HPP
+#define THREAD_CACHING_ALLOCATOR_HPP
+
+#include <cstddef>
+#include <cstdlib>
+#include <mutex>
+#include "../pson.h"
+
+namespace protoson {
+
+    /*
+     * Allocator for multi-threaded programs, safe to use as protoson::pool from any number of threads.
+     * Small blocks are grouped in power of two size classes and recycled through per-thread free lists,
+     * so the common allocate/deallocate path takes no lock. Threads exchange blocks in batches through
+     * a shared list protected by a mutex, so a block may be freed by a different thread than the one
+     * that allocated it. Larger blocks go straight to malloc and free.
+     *
+     * The allocator is thread safe, but pson trees are not: a tree (including subtrees shared with
+     * pson::share) must only be used by one thread at a time.
+     */
+    class thread_caching_memory_allocator : public memory_allocator{
+    private:
+        enum {
+            size_classes = 8,           // 16, 32, ... 2048 bytes
+            min_class_size = 16,
+            thread_cache_size = 64,     // blocks per size class kept by a thread
+            central_cache_size = 1024   // blocks per size class kept for all threads
+        };
+
+        // every block starts with its size class, keeping the payload aligned as malloc does
+        union header{
+            size_t size_class;
+            std::max_align_t alignment;
+        };
+
+        struct free_block{
+            free_block* next;
+        };
+
+        struct free_list{
+            free_block* head;
+            size_t count;
+
+            free_list() : head(NULL), count(0){
+            }
+
+            void push(free_block* block){
+                block->next = head;
+                head = block;
+                count++;
+            }
+
+            free_block* pop(){
+                free_block* block = head;
+                if(block!=NULL){
+                    head = block->next;
+                    count--;
+                }
+                return block;
+            }
+
+            // move up to count blocks to the given list
+            void transfer(free_list& destination, size_t count){
+                while(count-- > 0 && head!=NULL){
+                    destination.push(pop());
+                }
+            }
+
+            void release(){
+                while(free_block* block = pop()){
+                    free((header*) block - 1);
+                }
+            }
+        };
+
+        struct central_cache{
+            std::mutex mutex;
+            free_list lists[size_classes];
+
+            ~central_cache(){
+                for(size_t i=0; i<size_classes; i++){
+                    lists[i].release();
+                }
+            }
+        };
+
+        struct thread_cache{
+            free_list lists[size_classes];
+
+            // return the cached blocks when the thread exits
+            ~thread_cache(){
+                central_cache& shared = central();
+                std::lock_guard<std::mutex> lock(shared.mutex);
+                for(size_t i=0; i<size_classes; i++){
+                    give_back(lists[i], shared.lists[i], lists[i].count);
+                }
+            }
+        };
+
+        static central_cache& central(){
+            static central_cache cache;
+            return cache;
+        }
+
+        static thread_cache& local(){
+            static thread_local thread_cache cache;
+            return cache;
+        }
+
+        // move blocks to the central list, freeing the ones above its limit
+        static void give_back(free_list& source, free_list& destination, size_t count){
+            size_t room = destination.count < central_cache_size ? central_cache_size - destination.count : 0;
+            size_t kept = count < room ? count : room;
+            source.transfer(destination, kept);
+            for(count -= kept; count>0 && source.head!=NULL; count--){
+                free((header*) source.pop() - 1);
+            }
+        }
+
+        static size_t class_index(size_t size){
+            size_t index = 0;
+            for(size_t class_size = min_class_size; class_size < size && index < size_classes; class_size <<= 1){
+                index++;
+            }
+            return index;
+        }
+
+        static void* allocate_block(size_t size, size_t size_class){
+            header* block = (header*) malloc(sizeof(header) + size);
+            if(block==NULL) return NULL;
+            block->size_class = size_class;
+            return block + 1;
+        }
+
+    public:
+        virtual void *allocate(size_t size) {
+            size_t index = class_index(size);
+            if(index>=size_classes){
+                return allocate_block(size, size_classes);
+            }
+            free_list& list = local().lists[index];
+            if(list.head==NULL){
+                central_cache& shared = central();
+                std::lock_guard<std::mutex> lock(shared.mutex);
+                shared.lists[index].transfer(list, thread_cache_size / 2);
+            }
+            if(free_block* block = list.pop()){
+                return block;
+            }
+            return allocate_block((size_t) min_class_size << index, index);
+        }
+
+        virtual void deallocate(void *ptr) {
+            if(ptr==NULL) return;
+            header* block = (header*) ptr - 1;
+            if(block->size_class>=size_classes){
+                free(block);
+                return;
+            }
+            free_list& list = local().lists[block->size_class];
+            list.push((free_block*) ptr);
+            if(list.count>thread_cache_size){
+                central_cache& shared = central();
+                std::lock_guard<std::mutex> lock(shared.mutex);
+                give_back(list, shared.lists[block->size_class], thread_cache_size / 2);
+            }
+        }
+    };
+}
+
+#endif
@@ -0,0 +1,118 @@
+#define CATCH_CONFIG_MAIN  // This tells Catch to provide a main() - only do this in one cpp file
+
+// std::pmr interop, built as C++17 (see CMakeLists.txt), where the vendored Catch uses the deprecated
+// std::uncaught_exception()
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wdeprecated-declarations"
+#include "catch.hpp"
+#pragma GCC diagnostic pop
+#include <string>
+#include <vector>
+#include "../src/pson.h"
+#include "../src/util/pmr_allocator.hpp"
+
+// the global pool also goes through the default memory resource, so nothing uses malloc directly
+protoson::pmr_memory_allocator alloc;
+protoson::memory_allocator&protoson::pool = alloc;
+
+using namespace protoson;
+using namespace std;
+
+// memory resource that counts the bytes outstanding in its upstream resource
+class counting_resource : public std::pmr::memory_resource {
+public:
+    size_t live;
+    size_t allocations;
+
+    counting_resource() : live(0), allocations(0) {
+    }
+
+protected:
+    virtual void* do_allocate(size_t bytes, size_t alignment) {
+        allocations++;
+        live += bytes;
+        return std::pmr::new_delete_resource()->allocate(bytes, alignment);
+    }
+
+    virtual void do_deallocate(void* ptr, size_t bytes, size_t alignment) {
+        live -= bytes;
+        std::pmr::new_delete_resource()->deallocate(ptr, bytes, alignment);
+    }
+
+    virtual bool do_is_equal(const std::pmr::memory_resource& other) const noexcept {
+        return this==&other;
+    }
+};
+
+static void build(pson& document){
+    document["name"] = "a string that needs to be allocated";
+    document["id"] = 42;
+    pson_array& array = document["values"];
+    for(int i=0; i<20; i++){
+        array.add(i).add("another allocated string value");
+    }
+}
+
+TEST_CASE( "PSON Memory Resources", "[PSON]" ) {
+    counting_resource upstream;
+
+    SECTION("trees live in a monotonic buffer resource") {
+        std::pmr::monotonic_buffer_resource arena(&upstream);
+        pmr_memory_allocator allocator(&arena);
+        REQUIRE(allocator.trivial_deallocate());
+        {
+            pson document;
+            document.set_allocator(allocator);
+            build(document);
+            REQUIRE((int)document["id"]==42);
+            REQUIRE(string((const char*)(*((pson_array&)document["values"])[1]))=="another allocated string value");
+        }
+        REQUIRE(upstream.live>0);
+        arena.release();
+        REQUIRE(upstream.live==0);
+    }
+
+    SECTION("blocks are returned to a pool resource with their size") {
+        std::pmr::unsynchronized_pool_resource pool_resource(&upstream);
+        pmr_memory_allocator allocator(&pool_resource);
+        REQUIRE_FALSE(allocator.trivial_deallocate());
+        for(int i=0; i<10; i++){
+            pson document;
+            document.set_allocator(allocator);
+            build(document);
+        }
+        size_t allocations = upstream.allocations;
+        {
+            pson document;
+            document.set_allocator(allocator);
+            build(document);
+        }
+        // the pool reuses the blocks freed by the previous documents
+        REQUIRE(upstream.allocations==allocations);
+    }
+
+    SECTION("std::pmr containers are served by protoson allocators") {
+        arena_memory_allocator arena(256);
+        memory_allocator_resource resource(arena);
+        {
+            std::pmr::vector<int> values(&resource);
+            for(int i=0; i<100; i++){
+                values.push_back(i);
+            }
+            REQUIRE(values[99]==99);
+            REQUIRE(arena.used()>=100 * sizeof(int));
+        }
+        void* aligned = resource.allocate(100, 64);
+        REQUIRE(((uintptr_t)aligned % 64)==0);
+        resource.deallocate(aligned, 100, 64);
+
+        memory_allocator_resource same(arena);
+        REQUIRE(resource.is_equal(same));
+        memory_allocator_resource other(alloc);
+        REQUIRE_FALSE(resource.is_equal(other));
+
+        ring_memory_allocator<64> ring;
+        memory_allocator_resource bounded(ring);
+        REQUIRE_THROWS_AS((void) bounded.allocate(128), const std::bad_alloc&);
+    }
+}
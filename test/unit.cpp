@@ -1,15 +1,122 @@
 #define CATCH_CONFIG_MAIN  // This tells Catch to provide a main() - only do this in one cpp file
 
 #include "catch.hpp"
+#include <algorithm>
+#include <numeric>
+#include <functional>
 #include "../src/pson.h"
 #include "../src/util/json_encoder.hpp"
+#include "../src/util/json_decoder.hpp"
+#include "../src/util/json_parser.hpp"
+#include "../src/util/pson_json_transcoder.hpp"
+#include "../src/util/thread_caching_allocator.hpp"
+#include <thread>
+#include <vector>
+#include <memory>
 
-protoson::dynamic_memory_allocator alloc;
+// allocator that keeps track of the allocations performed, served by a replaceable backend
+class counting_memory_allocator : public protoson::memory_allocator {
+private:
+    protoson::dynamic_memory_allocator dynamic_;
+public:
+    protoson::memory_allocator* backend;
+    size_t allocations;
+    size_t deallocations;
+    size_t bytes;
+
+    counting_memory_allocator() : backend(&dynamic_), allocations(0), deallocations(0), bytes(0) {
+    }
+
+    virtual void *allocate(size_t size) {
+        allocations++;
+        bytes += size;
+        return backend->allocate(size);
+    }
+
+    virtual void deallocate(void *ptr) {
+        if(ptr!=NULL) deallocations++;
+        backend->deallocate(ptr);
+    }
+
+    virtual void deallocate(void *ptr, size_t size) {
+        if(ptr!=NULL) deallocations++;
+        backend->deallocate(ptr, size);
+    }
+
+    virtual bool trivial_deallocate() const{
+        return backend->trivial_deallocate();
+    }
+
+    // allocations still alive
+    size_t live() const{
+        return allocations - deallocations;
+    }
+
+    // serve allocations from the given allocator, or the dynamic one if NULL
+    void use(protoson::memory_allocator* allocator){
+        backend = allocator!=NULL ? allocator : &dynamic_;
+    }
+};
+
+counting_memory_allocator alloc;
 protoson::memory_allocator&protoson::pool = alloc;
 
 using namespace protoson;
 using namespace std;
 
+class memory_writer : public pson_encoder {
+private:
+    uint8_t* buffer_;
+    size_t size_;
+public:
+    memory_writer(uint8_t *buffer, size_t size) : buffer_(buffer), size_(size){
+    }
+
+protected:
+    virtual bool write(const void *buffer, size_t size) {
+        if(written_+size<=size_){
+            memcpy(&buffer_[written_], buffer, size);
+            return pson_encoder::write(buffer, size);
+        }
+        return false;
+    }
+};
+
+class memory_reader : public pson_decoder {
+private:
+    const uint8_t* buffer_;
+    size_t size_;
+public:
+    memory_reader(const uint8_t *buffer, size_t size) : buffer_(buffer), size_(size){
+    }
+
+protected:
+    virtual bool read(void *buffer, size_t size) {
+        if(read_+size<=size_){
+            memcpy(buffer, &buffer_[read_], size);
+            return pson_decoder::read(buffer, size);
+        }
+        return false;
+    }
+
+    virtual const void* read_reference(size_t size) {
+        if(read_+size<=size_){
+            const void* reference = &buffer_[read_];
+            read_ += size;
+            return reference;
+        }
+        return NULL;
+    }
+};
+
+// json text of a value, to compare whole documents
+static std::string to_json(pson& value){
+    std::ostringstream out_stream;
+    json_encoder encoder(out_stream);
+    encoder.encode(value);
+    return out_stream.str();
+}
+
 TEST_CASE( "PSON Reading", "[PSON-JSON]" ) {
     pson object;
 
@@ -357,4 +464,1574 @@ TEST_CASE( "PSON-JSON Encoding", "[PSON-JSON]" ) {
         encoder.encode(root);
         REQUIRE("[[5]]" == out_stream.str());
     }
-}
\ No newline at end of file
+}
+
+TEST_CASE( "PSON Ownership", "[PSON]" ) {
+    pson object;
+    object["int"] = 55;
+    object["string"] = "hello";
+    pson_array& array = object["list"];
+    array.add(1.5f);
+    array.add("world");
+
+    SECTION("move construction") {
+        pson moved(static_cast<pson&&>(object));
+        REQUIRE(object.is_empty());
+        REQUIRE(moved.is_object());
+        REQUIRE((int)moved["int"]==55);
+    }
+
+    SECTION("move assignment") {
+        pson moved;
+        moved = "previous";
+        moved = static_cast<pson&&>(object);
+        REQUIRE(object.is_empty());
+        REQUIRE(strcmp((const char*)moved["string"], "hello")==0);
+    }
+
+    SECTION("move a child into its parent") {
+        object = static_cast<pson&&>(object["list"]);
+        REQUIRE(object.is_array());
+        pson_array& list = object;
+        REQUIRE(list.size()==2);
+        REQUIRE(std::string((const char*)*list[1])=="world");
+
+        object = static_cast<pson&&>(*list[1]);
+        REQUIRE(std::string((const char*)object)=="world");
+    }
+
+    SECTION("deep clone") {
+        pson copy;
+        REQUIRE(object.clone(copy));
+        copy["other"] = 66;
+        ((pson_array&)copy["list"]).add(true);
+        REQUIRE((int)copy["int"]==55);
+        REQUIRE((int)copy["other"]==66);
+        REQUIRE(object["other"].is_empty());
+        REQUIRE(strcmp((const char*)copy["string"], "hello")==0);
+        REQUIRE(((pson_array&)object["list"]).size()==2);
+        REQUIRE(((pson_array&)copy["list"]).size()==3);
+        REQUIRE((float)*((pson_array&)copy["list"])[0]==1.5f);
+    }
+}
+
+
+TEST_CASE( "PSON Container Iterators", "[PSON]" ) {
+    pson object;
+    pson_array& array = object["array"];
+    array.add(5);
+    array.add(3);
+    array.add(9);
+    array.add(1);
+    array.add(7);
+
+    SECTION("random access") {
+        pson_array::iterator it = array.begin();
+        REQUIRE((array.end() - array.begin()) == 5);
+        REQUIRE((int)it[2] == 9);
+        REQUIRE((int)*(it + 4) == 7);
+        REQUIRE((int)*(array.end() - 1) == 7);
+    }
+
+    SECTION("stl algorithms") {
+        std::sort(array.begin(), array.end(), [](pson& a, pson& b){ return (int)a < (int)b; });
+        int expected[] = {1, 3, 5, 7, 9};
+        for(size_t i=0; i<array.size(); i++){
+            REQUIRE((int)*array[i] == expected[i]);
+        }
+        int sum = std::accumulate(array.begin(), array.end(), 0, [](int total, pson& value){ return total + (int)value; });
+        REQUIRE(sum == 25);
+    }
+
+    SECTION("range-based for on objects") {
+        object["key"] = "value";
+        const char* names[] = {"array", "key"};
+        size_t index = 0;
+        for(pson_pair& pair : (pson_object&)object){
+            REQUIRE(strcmp(pair.name(), names[index++])==0);
+        }
+        REQUIRE(index == 2);
+    }
+
+    SECTION("references survive growing containers") {
+        pson& first = object["first"];
+        pson& item = *array[0];
+        for(int i=0; i<10; i++){
+            object[std::string("key") + std::to_string(i)] = i;
+            array.add(i);
+        }
+        first = 5;
+        item = 6;
+        REQUIRE((int)object["first"] == 5);
+        REQUIRE((int)*array[0] == 6);
+
+        ((pson_object&)object).set_sorted_keys(true);
+        pson& key = object["key3"];
+        object["a"] = 1;
+        object["key35"] = 2;
+        key = 33;
+        REQUIRE((int)object["key3"] == 33);
+
+        object["sum"] = (int)object["first"] + (int)object["key9"];
+        REQUIRE((int)object["sum"] == 14);
+    }
+}
+
+
+TEST_CASE( "PSON Sorted Keys", "[PSON]" ) {
+    pson root;
+    ostringstream out_stream;
+    json_encoder encoder(out_stream);
+
+    SECTION("insertion keeps key order") {
+        pson_object& object = root;
+        object.set_sorted_keys(true);
+        root["b"] = 2;
+        root["c"] = 3;
+        root["a"] = 1;
+        REQUIRE((int)root["b"]==2);
+        REQUIRE(object.size()==3);
+        encoder.encode(root);
+        REQUIRE("{\"a\":1,\"b\":2,\"c\":3}" == out_stream.str());
+    }
+
+    SECTION("enabling sorts existing and nested pairs") {
+        root["z"] = 1;
+        root["nested"]["y"] = true;
+        root["nested"]["x"] = false;
+        root["a"] = "str";
+        ((pson_object&)root).set_sorted_keys(true, true);
+        REQUIRE(((pson_object&)root).find("missing")==NULL);
+        REQUIRE((int)*((pson_object&)root).find("z")==1);
+        encoder.encode(root);
+        REQUIRE("{\"a\":\"str\",\"nested\":{\"x\":false,\"y\":true},\"z\":1}" == out_stream.str());
+    }
+
+    SECTION("decoding produces canonical encoding") {
+        pson other;
+        root["one"] = 1;
+        root["two"] = 2;
+        root["three"]["b"] = 3;
+        root["three"]["a"] = 4;
+        other["three"]["a"] = 4;
+        other["three"]["b"] = 3;
+        other["two"] = 2;
+        other["one"] = 1;
+
+        uint8_t first[128], second[128];
+        memory_writer first_writer(first, sizeof(first)), second_writer(second, sizeof(second));
+        first_writer.encode(root);
+        second_writer.encode(other);
+
+        pson first_decoded, second_decoded;
+        memory_reader first_reader(first, first_writer.bytes_written());
+        memory_reader second_reader(second, second_writer.bytes_written());
+        first_reader.set_sorted_keys(true);
+        second_reader.set_sorted_keys(true);
+        REQUIRE(first_reader.decode(first_decoded));
+        REQUIRE(second_reader.decode(second_decoded));
+        REQUIRE(((pson_object&)first_decoded["three"]).sorted_keys());
+
+        memory_writer first_canonical(first, sizeof(first)), second_canonical(second, sizeof(second));
+        first_canonical.encode(first_decoded);
+        second_canonical.encode(second_decoded);
+        REQUIRE(first_canonical.bytes_written()==second_canonical.bytes_written());
+        REQUIRE(memcmp(first, second, first_canonical.bytes_written())==0);
+    }
+}
+
+
+TEST_CASE( "PSON Inline Numbers", "[PSON]" ) {
+    pson object;
+    size_t allocations = alloc.allocations;
+
+    SECTION("numbers do not allocate") {
+        object = 1234567;
+        REQUIRE((int)object==1234567);
+        object = -1234567;
+        REQUIRE((int)object==-1234567);
+        object = 555.66f;
+        REQUIRE((float)object==555.66f);
+        object = 555.66;
+        REQUIRE((double)object==555.66);
+        object = std::numeric_limits<uint64_t>::max();
+        REQUIRE((uint64_t)object==std::numeric_limits<uint64_t>::max());
+        REQUIRE(alloc.allocations==allocations);
+    }
+
+    SECTION("minimum signed values") {
+        object = std::numeric_limits<int64_t>::min();
+        REQUIRE(object.get_type()==pson::svarint_field);
+        REQUIRE((int64_t)object==std::numeric_limits<int64_t>::min());
+        object = std::numeric_limits<int32_t>::min();
+        REQUIRE((int32_t)object==std::numeric_limits<int32_t>::min());
+
+        pson_array& array = object;
+        array.add(std::numeric_limits<int64_t>::min());
+        array.add(std::numeric_limits<int32_t>::min());
+        uint8_t buffer[64];
+        memory_writer writer(buffer, sizeof(buffer));
+        writer.encode(object);
+        pson decoded;
+        memory_reader reader(buffer, writer.bytes_written());
+        REQUIRE(reader.decode(decoded));
+        pson_array& decoded_array = decoded;
+        REQUIRE((int64_t)*decoded_array[0]==std::numeric_limits<int64_t>::min());
+        REQUIRE((int32_t)*decoded_array[1]==std::numeric_limits<int32_t>::min());
+    }
+
+    SECTION("decoded numbers do not allocate") {
+        pson_array& array = object;
+        array.add(std::numeric_limits<uint64_t>::max());
+        array.add(-300);
+        array.add(0.5f);
+        array.add(123456.789012);
+
+        uint8_t buffer[64];
+        memory_writer writer(buffer, sizeof(buffer));
+        writer.encode(object);
+
+        pson decoded;
+        memory_reader reader(buffer, writer.bytes_written());
+        allocations = alloc.allocations;
+        REQUIRE(reader.decode(decoded));
+        // the array object, its item index and the four items
+        REQUIRE(alloc.allocations==allocations+6);
+        pson_array& decoded_array = decoded;
+        REQUIRE((uint64_t)*decoded_array[0]==std::numeric_limits<uint64_t>::max());
+        REQUIRE((int)*decoded_array[1]==-300);
+        REQUIRE((float)*decoded_array[2]==0.5f);
+        REQUIRE((double)*decoded_array[3]==123456.789012);
+    }
+    SECTION("decoded integers keep their native magnitude") {
+        object["big"] = (uint64_t) 1 << 40;
+        object["min"] = std::numeric_limits<int64_t>::min();
+        object["negative"] = -((int64_t) 1 << 35);
+
+        uint8_t buffer[64];
+        memory_writer writer(buffer, sizeof(buffer));
+        writer.encode(object);
+
+        pson decoded;
+        memory_reader reader(buffer, writer.bytes_written());
+        REQUIRE(reader.decode(decoded));
+        REQUIRE((uint64_t)decoded["big"]==((uint64_t) 1 << 40));
+        REQUIRE((int64_t)decoded["min"]==std::numeric_limits<int64_t>::min());
+        REQUIRE((int64_t)decoded["negative"]==-((int64_t) 1 << 35));
+    }
+}
+
+
+TEST_CASE( "PSON Inline Strings", "[PSON]" ) {
+    pson object;
+    size_t allocations = alloc.allocations;
+
+    SECTION("short strings do not allocate") {
+        object = "online";
+        REQUIRE(object.is_string());
+        REQUIRE(strcmp((const char*)object, "online")==0);
+        object = std::string("ok");
+        REQUIRE(strcmp((const char*)object, "ok")==0);
+        REQUIRE(alloc.allocations==allocations);
+    }
+
+    SECTION("long strings are allocated") {
+        object = "a longer string value";
+        REQUIRE(alloc.allocations==allocations+1);
+        REQUIRE(strcmp((const char*)object, "a longer string value")==0);
+        object = "short";
+        REQUIRE(strcmp((const char*)object, "short")==0);
+    }
+
+    SECTION("decoded and cloned short strings stay inline") {
+        pson_array& array = object;
+        array.add("id");
+        array.add("a longer string value");
+
+        uint8_t buffer[64];
+        memory_writer writer(buffer, sizeof(buffer));
+        writer.encode(object);
+
+        pson decoded;
+        memory_reader reader(buffer, writer.bytes_written());
+        allocations = alloc.allocations;
+        REQUIRE(reader.decode(decoded));
+        // the array object, its item index, the two items and the long string
+        REQUIRE(alloc.allocations==allocations+5);
+
+        pson copy;
+        REQUIRE(decoded.clone(copy));
+        pson_array& copy_array = copy;
+        REQUIRE(strcmp((const char*)*copy_array[0], "id")==0);
+        REQUIRE(strcmp((const char*)*copy_array[1], "a longer string value")==0);
+    }
+}
+
+
+TEST_CASE( "PSON References", "[PSON]" ) {
+    pson object;
+    size_t allocations = alloc.allocations;
+
+    SECTION("referenced bytes") {
+        uint8_t bytes[4] = {1, 2, 3, 4};
+        object.set_bytes_ref(bytes, sizeof(bytes));
+        REQUIRE(object.is_bytes());
+        REQUIRE(object.is_reference());
+        uint8_t* data = NULL;
+        size_t size = 0;
+        REQUIRE(object.get_bytes(data, size));
+        REQUIRE((void*)data==(void*)bytes);
+        REQUIRE(size==4);
+        REQUIRE(alloc.allocations==allocations);
+    }
+
+    SECTION("referenced strings are copied on c string access") {
+        const char* text = "status:online";
+        object.set_string_ref(text, 6);
+        const char* str = NULL;
+        size_t size = 0;
+        REQUIRE(object.get_string(str, size));
+        REQUIRE((void*)str==(void*)text);
+        REQUIRE(size==6);
+        REQUIRE(alloc.allocations==allocations);
+        REQUIRE(strcmp((const char*)object, "status")==0);
+        REQUIRE(!object.is_reference());
+    }
+
+    SECTION("zero copy decoding") {
+        uint8_t payload[32];
+        memset(payload, 7, sizeof(payload));
+        object["blob"].set_bytes(payload, sizeof(payload));
+        object["text"] = "a string referenced from the input";
+        object["id"] = "short";
+
+        uint8_t buffer[128];
+        memory_writer writer(buffer, sizeof(buffer));
+        writer.encode(object);
+
+        pson decoded;
+        memory_reader reader(buffer, writer.bytes_written());
+        reader.set_zero_copy(true);
+        allocations = alloc.allocations;
+        REQUIRE(reader.decode(decoded));
+
+        uint8_t* data = NULL;
+        size_t size = 0;
+        REQUIRE(decoded["blob"].get_bytes(data, size));
+        REQUIRE(size==sizeof(payload));
+        REQUIRE((size_t)(data-buffer)<sizeof(buffer));
+        REQUIRE(decoded["text"].is_reference());
+        REQUIRE(!decoded["id"].is_reference());
+
+        uint8_t encoded[128];
+        memory_writer reencoder(encoded, sizeof(encoded));
+        reencoder.encode(decoded);
+        REQUIRE(reencoder.bytes_written()==writer.bytes_written());
+        REQUIRE(memcmp(encoded, buffer, writer.bytes_written())==0);
+    }
+}
+
+
+TEST_CASE( "PSON Sized Strings", "[PSON]" ) {
+    pson root;
+
+    SECTION("strings with null characters") {
+        std::string value("a\0b", 3);
+        root = value;
+        const char* str = NULL;
+        size_t size = 0;
+        REQUIRE(root.get_string(str, size));
+        REQUIRE(size==3);
+        REQUIRE(std::string(str, size)==value);
+    }
+
+    SECTION("keys with explicit size") {
+        pson_object& object = root;
+        object.get("key:suffix", 3) = 5;
+        REQUIRE((int)root["key"]==5);
+        REQUIRE(object.find("key:other", 3)!=NULL);
+        REQUIRE(object.find("key:other", 4)==NULL);
+        REQUIRE((int)root[std::string("key")]==5);
+        REQUIRE(object.begin()->name_size()==3);
+    }
+
+    SECTION("sized strings survive encoding") {
+        std::string key("k\0ey", 4);
+        std::string value("val\0ue with a null", 18);
+        root[key] = value;
+
+        uint8_t buffer[64];
+        memory_writer writer(buffer, sizeof(buffer));
+        writer.encode(root);
+
+        pson decoded;
+        memory_reader reader(buffer, writer.bytes_written());
+        REQUIRE(reader.decode(decoded));
+        REQUIRE(((pson_object&)decoded).begin()->name_size()==4);
+        const char* str = NULL;
+        size_t size = 0;
+        REQUIRE(decoded[key].get_string(str, size));
+        REQUIRE(std::string(str, size)==value);
+    }
+
+    SECTION("json output escapes sized strings") {
+        ostringstream out_stream;
+        json_encoder encoder(out_stream);
+        root[std::string("a\"b")] = std::string("line\nbreak\0", 11);
+        encoder.encode(root);
+        REQUIRE("{\"a\\\"b\":\"line\\nbreak\\u0000\"}" == out_stream.str());
+        REQUIRE(json_encoder::escape_string(std::string("tab\t\"\x01", 6))=="tab\\t\\\"\\u0001");
+    }
+}
+
+TEST_CASE( "PSON Memory Footprint", "[PSON]" ) {
+    pson root;
+
+    SECTION("short keys are stored inline") {
+        pson_object& object = root;
+        size_t allocations = alloc.allocations;
+        object["short_key"] = 1;
+        REQUIRE(alloc.allocations==allocations+2); // pair index and pair only
+        object["a_much_longer_key_name"] = 2;
+        REQUIRE(alloc.allocations==allocations+4);
+        REQUIRE(std::string(object.begin()->name())=="short_key");
+        REQUIRE((int)root["a_much_longer_key_name"]==2);
+    }
+
+    SECTION("unnamed and empty names") {
+        pson_pair pair;
+        REQUIRE(pair.name()==NULL);
+        REQUIRE(pair.name_size()==0);
+        pair.set_name("");
+        REQUIRE(pair.name()!=NULL);
+        REQUIRE(pair.name_size()==0);
+    }
+
+    SECTION("footprint matches the allocated bytes") {
+        size_t bytes = alloc.bytes;
+        root["id"] = 12345;
+        root["name"] = "a string that does not fit inline";
+        pson_array& array = root["a_key_that_is_long_enough"];
+        array.add(1).add("another long string value").add(2.5);
+        uint8_t data[] = {1, 2, 3};
+        root["data"].set_bytes(data, sizeof(data));
+        REQUIRE(root.allocated_size()==alloc.bytes-bytes);
+        REQUIRE(root.footprint()==sizeof(pson)+root.allocated_size());
+    }
+
+    SECTION("references and inline values do not count") {
+        root = 1234.5;
+        REQUIRE(root.allocated_size()==0);
+        root = "short";
+        REQUIRE(root.allocated_size()==0);
+        root.set_string_ref("a referenced string that is long", 32);
+        REQUIRE(root.allocated_size()==0);
+        root = "an owned string that is long";
+        REQUIRE(root.allocated_size()==29);
+    }
+}
+
+TEST_CASE( "PSON Shared Subtrees", "[PSON]" ) {
+    pson config;
+    config["name"] = "a configuration name";
+    config["network"]["host"] = "example.com";
+    config["network"]["port"] = 8080;
+    config["limits"]["max"] = 10;
+    pson_array& list = config["list"];
+    list.add(1).add(2).add_object()["deep"] = true;
+
+    SECTION("sharing does not copy") {
+        size_t allocations = alloc.allocations;
+        pson copy;
+        REQUIRE(config.share(copy));
+        REQUIRE(alloc.allocations==allocations);
+        REQUIRE(copy.get_object()==config.get_object());
+        REQUIRE(copy.get_object()->is_shared());
+    }
+
+    SECTION("reading a shared tree does not copy it") {
+        pson copy;
+        config.share(copy);
+        size_t allocations = alloc.allocations;
+        const pson& value = *copy.get_object()->find("network");
+        REQUIRE(value.get_object()->find("port")->get_value<int>()==8080);
+        const char* str = NULL;
+        size_t size = 0;
+        REQUIRE(value.get_object()->find("host")->get_string(str, size));
+        REQUIRE(std::string(str, size)=="example.com");
+        REQUIRE((*copy.get_object()->find("list")->get_array())[1]->get_value<int>()==2);
+        REQUIRE(alloc.allocations==allocations);
+    }
+
+    SECTION("writes copy only the modified path") {
+        pson copy;
+        config.share(copy);
+        copy["network"]["port"] = 9090;
+
+        REQUIRE((int)copy["network"]["port"]==9090);
+        REQUIRE((int)config["network"]["port"]==8080);
+        REQUIRE(copy.get_object()!=config.get_object());
+        REQUIRE(copy.get_object()->find("network")->get_object()!=config.get_object()->find("network")->get_object());
+        // untouched subtrees are still shared
+        REQUIRE(copy.get_object()->find("limits")->get_object()==config.get_object()->find("limits")->get_object());
+        REQUIRE(copy.get_object()->find("list")->get_array()==config.get_object()->find("list")->get_array());
+    }
+
+    SECTION("arrays are copied on write") {
+        pson copy;
+        config.share(copy);
+        pson_array& copy_list = copy["list"];
+        copy_list.add(3);
+        REQUIRE(copy_list.size()==4);
+        REQUIRE(config.get_object()->find("list")->get_array()->size()==3);
+        REQUIRE((bool)(*copy_list[2])["deep"]);
+        REQUIRE(config.get_object()->find("list")->get_array()->size()==3);
+    }
+
+    SECTION("shared storage outlives any of its owners") {
+        pson copy;
+        config.share(copy);
+        config = 1;
+        REQUIRE(!copy.get_object()->is_shared());
+        REQUIRE((int)copy["network"]["port"]==8080);
+        REQUIRE(std::string((const char*)copy["name"])=="a configuration name");
+    }
+
+    SECTION("scalars are cloned") {
+        pson value = "a string that is not inline";
+        pson copy;
+        REQUIRE(value.share(copy));
+        REQUIRE(copy.get_value()!=value.get_value());
+        REQUIRE(std::string((const char*)copy)=="a string that is not inline");
+    }
+}
+
+TEST_CASE( "PSON Retyping", "[PSON]" ) {
+    uint8_t data[] = {1, 2, 3};
+
+    SECTION("every transition releases the previous payload") {
+        size_t live = alloc.live();
+        {
+            pson value;
+            for(int i=0; i<10; i++){
+                value = "a string long enough to be allocated";
+                ((pson_object&)value)["key"] = "another long allocated string";
+                ((pson_array&)value).add("a long string inside an array");
+                value.set_bytes(data, sizeof(data));
+                ((pson_object&)value)["nested"]["array"].set_null();
+                value.set_null();
+                value = 12345;
+                value.set_type(pson::string_field);
+            }
+            REQUIRE(value.get_type()==pson::string_field);
+        }
+        REQUIRE(alloc.live()==live);
+    }
+
+    SECTION("objects and arrays replace previous values") {
+        pson value = 5;
+        pson_object& object = value;
+        object["a"] = 1;
+        REQUIRE(value.is_object());
+        REQUIRE((int)value["a"]==1);
+        pson_array& array = value;
+        REQUIRE(value.is_array());
+        REQUIRE(array.size()==0);
+    }
+
+    SECTION("scalar reassignment is not ignored") {
+        pson value;
+        value = 300;
+        value = 1.5f;
+        REQUIRE((float)value==1.5f);
+        value.set_type(pson::bytes_field);
+        REQUIRE(value.allocate_bytes(4)!=NULL);
+        value = -7;
+        REQUIRE((int)value==-7);
+    }
+
+    SECTION("strings of the same size reuse their storage") {
+        pson value = "2026-10-18T10:00:00Z";
+        size_t allocations = alloc.allocations;
+        const void* storage = value.get_value();
+        value = "2026-10-18T10:00:01Z";
+        REQUIRE(alloc.allocations==allocations);
+        REQUIRE(value.get_value()==storage);
+        REQUIRE(std::string((const char*)value)=="2026-10-18T10:00:01Z");
+    }
+}
+
+TEST_CASE( "PSON Arena Allocator", "[PSON]" ) {
+    arena_memory_allocator arena(256);
+    alloc.use(&arena);
+
+    SECTION("allocations are aligned and served from blocks") {
+        void* first = arena.allocate(1);
+        void* second = arena.allocate(3);
+        REQUIRE(((uintptr_t)first % sizeof(void*))==0);
+        REQUIRE(((uintptr_t)second % sizeof(void*))==0);
+        REQUIRE((uint8_t*)second > (uint8_t*)first);
+        REQUIRE(arena.capacity()==256);
+        // larger allocations take a dedicated block
+        REQUIRE(arena.allocate(1000)!=NULL);
+        REQUIRE(arena.capacity()==1256);
+    }
+
+    SECTION("documents are discarded without per-node deallocation") {
+        for(int message=0; message<10; message++){
+            {
+                pson document;
+                document["id"] = message;
+                document["name"] = "a string that needs to be allocated";
+                pson_array& array = document["values"];
+                for(int i=0; i<20; i++){
+                    array.add(i).add("another allocated string value");
+                }
+                REQUIRE((int)document["id"]==message);
+                size_t deallocations = alloc.deallocations;
+                document = 0;
+                // only the root object and its item storage are handed back
+                REQUIRE(alloc.deallocations==deallocations+2);
+            }
+            size_t capacity = arena.capacity();
+            arena.reset();
+            REQUIRE(arena.used()==0);
+            REQUIRE(arena.capacity()<=capacity);
+        }
+    }
+
+    SECTION("release returns every block") {
+        arena.allocate(100);
+        arena.allocate(2000);
+        arena.release();
+        REQUIRE(arena.capacity()==0);
+        REQUIRE(arena.allocate(10)!=NULL);
+    }
+
+    alloc.use(NULL);
+}
+
+TEST_CASE( "PSON Tree Allocators", "[PSON]" ) {
+    arena_memory_allocator arena(512);
+    pson document;
+    document.set_allocator(arena);
+
+    SECTION("trees allocate from their own allocator") {
+        size_t allocations = alloc.allocations;
+        document["name"] = "a string that needs to be allocated";
+        document["a_long_key_that_is_not_inline"] = 1;
+        pson_array& array = document["array"];
+        array.add("another long string to allocate");
+        array.add_object()["nested"]["deep"] = "yet another long string value";
+        REQUIRE(alloc.allocations==allocations);
+        REQUIRE(arena.used()>0);
+        REQUIRE(&((pson_object&)document).get_allocator()==&arena);
+        REQUIRE(&document["array"].get_allocator()==&arena);
+    }
+
+    SECTION("decoders bind values to their allocator") {
+        pson source;
+        source["name"] = "a string that needs to be allocated";
+        source["list"]["item"] = "another long string to allocate";
+        uint8_t buffer[128];
+        memory_writer writer(buffer, sizeof(buffer));
+        writer.encode(source);
+
+        size_t allocations = alloc.allocations;
+        pson decoded;
+        memory_reader reader(buffer, writer.bytes_written());
+        reader.set_allocator(&arena);
+        REQUIRE(reader.decode(decoded));
+        REQUIRE(alloc.allocations==allocations);
+        REQUIRE(&decoded.get_allocator()==&arena);
+        REQUIRE(std::string((const char*)decoded["list"]["item"])=="another long string to allocate");
+    }
+
+    SECTION("values crossing allocators are copied") {
+        document["name"] = "a string that needs to be allocated";
+        document["list"]["item"] = 5;
+
+        pson copy;
+        REQUIRE(document.clone(copy));
+        REQUIRE(&copy.get_allocator()==&pool);
+        REQUIRE(((pson_object&)copy)["list"].get_allocator().trivial_deallocate()==false);
+
+        pson shared;
+        REQUIRE(document.share(shared));
+        REQUIRE(shared.get_object()!=document.get_object());
+
+        pson moved;
+        moved = static_cast<pson&&>(document);
+        REQUIRE(document.is_empty());
+        REQUIRE(&moved.get_allocator()==&pool);
+        REQUIRE((int)moved["list"]["item"]==5);
+    }
+
+    SECTION("moving within an allocator does not copy") {
+        pson other;
+        other.set_allocator(arena);
+        document["name"] = "a string that needs to be allocated";
+        const void* storage = document["name"].get_value();
+        other = static_cast<pson&&>(document["name"]);
+        REQUIRE(other.get_value()==storage);
+    }
+
+    SECTION("pairs moved across allocators copy their names") {
+        document["a_long_key_that_is_not_inline"] = "a string that needs to be allocated";
+        pson_pair& source = *((pson_object&)document).begin();
+        pson_pair pair;
+        pair = static_cast<pson_pair&&>(source);
+        REQUIRE(std::string(pair.name())=="a_long_key_that_is_not_inline");
+        REQUIRE(std::string((const char*)pair.value())=="a string that needs to be allocated");
+        REQUIRE(&pair.value().get_allocator()==&pool);
+        REQUIRE(source.name()==NULL);
+        REQUIRE(source.value().is_empty());
+    }
+
+    SECTION("failed copies keep the source") {
+        ring_memory_allocator<32> small;
+        pson other;
+        other.set_allocator(small);
+        document["name"] = "a string that needs to be allocated";
+        other = static_cast<pson&&>(document["name"]);
+        REQUIRE(std::string((const char*)document["name"])=="a string that needs to be allocated");
+    }
+
+    SECTION("nodes refer to their allocator by index") {
+        REQUIRE(sizeof(pson)==16);
+        REQUIRE(&((pson_array&)document["array"]).get_allocator()==&arena);
+
+        std::vector<std::unique_ptr<arena_memory_allocator>> arenas;
+        for(int i=0; i<PSON_MAX_ALLOCATORS; i++){
+            arenas.push_back(std::unique_ptr<arena_memory_allocator>(new arena_memory_allocator()));
+        }
+        REQUIRE_FALSE(arenas.back()->registered());
+        pson other;
+        REQUIRE_FALSE(other.set_allocator(*arenas.back()));
+        REQUIRE(&other.get_allocator()==&pool);
+
+        // destroyed allocators free their entry
+        arenas.erase(arenas.begin());
+        arena_memory_allocator next;
+        REQUIRE(next.registered());
+        pson value;
+        REQUIRE(value.set_allocator(next));
+        value = "a string that needs to be allocated";
+        REQUIRE(next.used()>0);
+    }
+
+    SECTION("allocators register from several threads") {
+        std::vector<std::thread> workers;
+        std::vector<int> failures(4, 0);
+        for(int t=0; t<4; t++){
+            workers.push_back(std::thread([&failures, t](){
+                for(int i=0; i<100; i++){
+                    arena_memory_allocator local(128);
+                    pson value;
+                    if(!value.set_allocator(local) || &value.get_allocator()!=&local) failures[t]++;
+                }
+            }));
+        }
+        for(size_t t=0; t<workers.size(); t++) workers[t].join();
+        for(size_t t=0; t<failures.size(); t++) REQUIRE(failures[t]==0);
+    }
+}
+
+TEST_CASE( "PSON Thread Caching Allocator", "[PSON]" ) {
+    thread_caching_memory_allocator caching;
+
+    SECTION("blocks are aligned and recycled") {
+        void* first = caching.allocate(24);
+        REQUIRE(((uintptr_t)first % sizeof(void*))==0);
+        caching.deallocate(first);
+        REQUIRE(caching.allocate(20)==first);
+        caching.deallocate(first);
+        void* large = caching.allocate(100000);
+        REQUIRE(large!=NULL);
+        memset(large, 0, 100000);
+        caching.deallocate(large);
+        caching.deallocate(NULL);
+    }
+
+    SECTION("blocks can be freed by other threads") {
+        std::vector<void*> blocks;
+        for(int i=0; i<1000; i++){
+            blocks.push_back(caching.allocate(i % 300));
+        }
+        std::thread consumer([&](){
+            for(size_t i=0; i<blocks.size(); i++){
+                caching.deallocate(blocks[i]);
+            }
+        });
+        consumer.join();
+        for(int i=0; i<1000; i++){
+            blocks[i] = caching.allocate(i % 300);
+        }
+        for(size_t i=0; i<blocks.size(); i++){
+            caching.deallocate(blocks[i]);
+        }
+    }
+
+    SECTION("concurrent documents") {
+        std::vector<std::thread> workers;
+        std::vector<int> results(4, 0);
+        for(int t=0; t<4; t++){
+            workers.push_back(std::thread([&caching, &results, t](){
+                for(int i=0; i<200; i++){
+                    pson document;
+                    document.set_allocator(caching);
+                    document["name"] = "a string that needs to be allocated";
+                    pson_array& array = document["values"];
+                    for(int j=0; j<10; j++){
+                        array.add(j).add("another allocated string value");
+                    }
+                    results[t] += (int)(*array[18]);
+                }
+            }));
+        }
+        for(size_t t=0; t<workers.size(); t++){
+            workers[t].join();
+        }
+        REQUIRE(std::accumulate(results.begin(), results.end(), 0)==4*200*9);
+    }
+}
+
+TEST_CASE( "PSON Slab Allocator", "[PSON]" ) {
+    slab_memory_allocator slab(1024);
+
+    SECTION("blocks of a size class are recycled") {
+        void* first = slab.allocate(20);
+        void* second = slab.allocate(24);
+        REQUIRE(((uintptr_t)first % sizeof(void*))==0);
+        REQUIRE(second==(void*)((uint8_t*)first+24));
+        slab.deallocate(first, 20);
+        REQUIRE(slab.allocate(17)==first);
+        REQUIRE(slab.capacity()==1024);
+        // large blocks do not use the slabs
+        void* large = slab.allocate(1000);
+        slab.deallocate(large, 1000);
+        REQUIRE(slab.capacity()==1024);
+    }
+
+    SECTION("trees return sized blocks") {
+        alloc.use(&slab);
+        for(int i=0; i<5; i++){
+            pson document;
+            document["name"] = "a string that needs to be allocated";
+            document["a_long_key_that_is_not_inline"] = i;
+            pson_array& array = document["values"];
+            for(int j=0; j<20; j++){
+                array.add(j).add("another allocated string value");
+            }
+            uint8_t data[300] = {0};
+            document["data"].set_bytes(data, sizeof(data));
+            REQUIRE((int)(*array[38])==19);
+        }
+        // every document reuses the blocks released by the previous one
+        REQUIRE(slab.capacity()<=4096);
+        alloc.use(NULL);
+    }
+
+    SECTION("unsized deallocation") {
+        void* block = slab.allocate(32);
+        void* large = slab.allocate(512);
+        slab.deallocate(block);
+        slab.deallocate(large);
+        REQUIRE(slab.allocate(32)!=block);
+    }
+}
+
+TEST_CASE( "PSON Instrumented Allocator", "[PSON]" ) {
+    dynamic_memory_allocator dynamic;
+    instrumented_memory_allocator instrumented(dynamic);
+
+    SECTION("live bytes follow the document") {
+        uint8_t buffer[256];
+        memory_writer writer(buffer, sizeof(buffer));
+        {
+            pson source;
+            source["name"] = "a string that needs to be allocated";
+            source["a_long_key_that_is_not_inline"]["value"] = 5;
+            source["list"].set_bytes(buffer, 20);
+            writer.encode(source);
+        }
+
+        {
+            pson decoded;
+            memory_reader reader(buffer, writer.bytes_written());
+            reader.set_allocator(&instrumented);
+            REQUIRE(reader.decode(decoded));
+            const instrumented_memory_allocator::statistics& stats = instrumented.stats();
+            REQUIRE(stats.live_bytes==decoded.allocated_size());
+            REQUIRE(stats.allocated_bytes==stats.live_bytes);
+            REQUIRE(stats.peak_bytes==stats.live_bytes);
+            REQUIRE(stats.deallocations==0);
+            REQUIRE(std::accumulate(stats.histogram, stats.histogram + instrumented_memory_allocator::histogram_size, (size_t)0)==stats.allocations);
+        }
+        REQUIRE(instrumented.stats().live_bytes==0);
+        REQUIRE(instrumented.stats().deallocations==instrumented.stats().allocations);
+        REQUIRE(instrumented.stats().peak_bytes>0);
+    }
+
+    SECTION("payloads are released with their size") {
+        uint8_t bytes[40] = {0};
+        pson value;
+        value.set_allocator(instrumented);
+        REQUIRE(value.allocate_bytes(40)!=NULL);
+        value = "a string that needs to be allocated";
+        value.set_bytes(bytes, 30);
+        REQUIRE(instrumented.stats().live_bytes==30);
+        value.set_type(pson::string_field);
+        REQUIRE((void*)value.allocate_string(20)!=NULL);
+        REQUIRE(instrumented.stats().live_bytes==21);
+        value = 5;
+        REQUIRE(instrumented.stats().live_bytes==0);
+        REQUIRE(instrumented.stats().deallocations==instrumented.stats().allocations);
+    }
+
+    SECTION("histogram and reset") {
+        void* small = instrumented.allocate(3);
+        void* large = instrumented.allocate(100);
+        REQUIRE(instrumented.stats().histogram[2]==1);
+        REQUIRE(instrumented.stats().histogram[7]==1);
+        instrumented.deallocate(large, 100);
+        REQUIRE(instrumented.stats().peak_bytes==103);
+        instrumented.reset();
+        REQUIRE(instrumented.stats().allocations==0);
+        REQUIRE(instrumented.stats().live_bytes==3);
+        REQUIRE(instrumented.stats().peak_bytes==3);
+        instrumented.deallocate(small, 3);
+        REQUIRE(instrumented.stats().live_bytes==0);
+    }
+
+    SECTION("failed allocations") {
+        circular_memory_allocator<64> circular;
+        instrumented_memory_allocator limited(circular);
+        REQUIRE(limited.allocate(128)==NULL);
+        REQUIRE(limited.stats().failed_allocations==1);
+        REQUIRE(limited.stats().allocations==0);
+    }
+}
+
+TEST_CASE( "PSON Ring Allocator", "[PSON]" ) {
+    ring_memory_allocator<256, 2> ring;
+
+    SECTION("live messages are never overwritten") {
+        uint32_t first = ring.begin_message();
+        REQUIRE(first!=0);
+        void* a = ring.allocate(100);
+        REQUIRE(a!=NULL);
+        uint32_t second = ring.begin_message();
+        void* b = ring.allocate(100);
+        REQUIRE(b!=NULL);
+        REQUIRE(ring.allocate(100)==NULL);
+        REQUIRE(ring.begin_message()==0);
+
+        // only the oldest message can be released
+        REQUIRE_FALSE(ring.release_message(second));
+        REQUIRE(ring.release_message(first));
+        REQUIRE(ring.live_messages()==1);
+
+        // the ring wraps over the released message, but not over the live one
+        uint32_t third = ring.begin_message();
+        void* c = ring.allocate(100);
+        REQUIRE(c==a);
+        REQUIRE(ring.allocate(16)==NULL);
+        REQUIRE(ring.release_message(second));
+        REQUIRE(ring.allocate(64)!=NULL);
+        REQUIRE(ring.release_message(third));
+        REQUIRE(ring.used()==0);
+        REQUIRE(ring.allocate(256)!=NULL);
+    }
+
+    SECTION("decoding fails instead of overwriting") {
+        ring_memory_allocator<768> stream;
+        uint8_t buffer[256];
+        memory_writer writer(buffer, sizeof(buffer));
+        {
+            pson source;
+            pson_array& array = source["values"];
+            array.add("a string that needs to be allocated");
+            array.add("another string that needs to be allocated");
+            array.add("yet another string to be allocated");
+            writer.encode(source);
+        }
+
+        pson first, second, third;
+        uint32_t generations[3];
+        pson* documents[3] = {&first, &second, &third};
+        for(int i=0; i<3; i++){
+            generations[i] = stream.begin_message();
+            memory_reader reader(buffer, writer.bytes_written());
+            reader.set_allocator(&stream);
+            REQUIRE(reader.decode(*documents[i])==(i<2));
+        }
+        REQUIRE(std::string((const char*)(*((pson_array&)first["values"])[1]))=="another string that needs to be allocated");
+
+        for(int i=0; i<3; i++){
+            *documents[i] = 0;
+            REQUIRE(stream.release_message(generations[i]));
+        }
+        stream.begin_message();
+        memory_reader reader(buffer, writer.bytes_written());
+        reader.set_allocator(&stream);
+        REQUIRE(reader.decode(third));
+    }
+}
+
+TEST_CASE( "PSON Inline Arena Allocator", "[PSON]" ) {
+    counting_memory_allocator heap;
+
+    SECTION("small messages are decoded without heap allocations") {
+        uint8_t buffer[256];
+        memory_writer writer(buffer, sizeof(buffer));
+        {
+            pson command;
+            command["device"] = "actuator-07";
+            command["command"] = "set_position";
+            command["sequence"] = 1234;
+            command["position"] = 12.5;
+            pson_array& limits = command["limits"];
+            limits.add(-90).add(90);
+            command["reason"] = "scheduled adjustment from the control loop";
+            writer.encode(command);
+        }
+        REQUIRE(writer.bytes_written()<=200);
+
+        inline_arena_memory_allocator<1024> arena(heap);
+        {
+            pson command;
+            memory_reader reader(buffer, writer.bytes_written());
+            reader.set_allocator(&arena);
+            REQUIRE(reader.decode(command));
+            REQUIRE((int)command["sequence"]==1234);
+            REQUIRE(std::string((const char*)command["reason"])=="scheduled adjustment from the control loop");
+        }
+        REQUIRE(heap.allocations==0);
+        REQUIRE(arena.spilled()==0);
+        arena.reset();
+        REQUIRE(arena.used()==0);
+    }
+
+    SECTION("allocations spill to the fallback when the buffer is full") {
+        inline_arena_memory_allocator<128> arena(heap);
+        {
+            pson document;
+            document.set_allocator(arena);
+            pson_array& array = document["values"];
+            for(int i=0; i<10; i++){
+                array.add("a string that needs to be allocated");
+            }
+            REQUIRE(arena.spilled()>0);
+            REQUIRE_FALSE(arena.trivial_deallocate());
+            REQUIRE(heap.live()==arena.spilled());
+        }
+        REQUIRE(heap.live()==0);
+        REQUIRE(arena.spilled()==0);
+    }
+
+    SECTION("the last inline allocation is given back") {
+        inline_arena_memory_allocator<64> arena(heap);
+        void* first = arena.allocate(10);
+        void* second = arena.allocate(20);
+        arena.deallocate(second, 20);
+        REQUIRE(arena.allocate(20)==second);
+        arena.deallocate(first, 10);
+        REQUIRE(arena.used()>0);
+        void* spilled = arena.allocate(64);
+        REQUIRE(spilled!=NULL);
+        REQUIRE(heap.allocations==1);
+        REQUIRE(arena.spilled()==1);
+        arena.deallocate(spilled, 64);
+        REQUIRE(heap.live()==0);
+    }
+}
+
+TEST_CASE( "PSON String Heap", "[PSON]" ) {
+    uint8_t buffer[1024];
+    memory_writer writer(buffer, sizeof(buffer));
+    {
+        pson source;
+        pson_array& readings = source["readings"];
+        for(int i=0; i<10; i++){
+            pson_object& object = *readings.create_item();
+            object["temperature_celsius"] = 20 + i;
+            object["status"] = i % 3 ? "operational" : "maintenance required";
+            object["unit"] = "degrees celsius";
+        }
+        writer.encode(source);
+    }
+
+    pson expected;
+    {
+        memory_reader reader(buffer, writer.bytes_written());
+        REQUIRE(reader.decode(expected));
+    }
+
+    SECTION("strings and long names are stored once") {
+        size_t allocations = alloc.allocations;
+        {
+            pson copied;
+            memory_reader reader(buffer, writer.bytes_written());
+            REQUIRE(reader.decode(copied));
+        }
+        size_t copied_allocations = alloc.allocations - allocations;
+
+        pson_string_heap heap;
+        pson decoded;
+        allocations = alloc.allocations;
+        memory_reader reader(buffer, writer.bytes_written());
+        reader.set_string_heap(&heap);
+        REQUIRE(reader.decode(decoded));
+        // 10 status and unit values and long keys, reduced to 4 strings in a single chunk
+        REQUIRE(heap.strings()==4);
+        REQUIRE(heap.deduplicated()==26);
+        size_t heap_allocations = alloc.allocations - allocations;
+        REQUIRE(heap_allocations <= copied_allocations - 28);
+        REQUIRE(to_json(decoded)==to_json(expected));
+
+        // deduplicated values share the same storage, and are read in place
+        pson_array& readings = decoded["readings"];
+        pson_object& first = *readings[0];
+        pson_object& second = *readings[3];
+        allocations = alloc.allocations;
+        const char* unit = first["unit"];
+        REQUIRE((const void*)unit==(const void*)(const char*)second["unit"]);
+        REQUIRE(alloc.allocations==allocations);
+        REQUIRE(first["unit"].is_reference());
+        REQUIRE(first.allocated_size()<=second.allocated_size());
+    }
+
+    SECTION("values referencing the heap can be replaced") {
+        pson_string_heap heap(alloc, 64);
+        pson decoded;
+        memory_reader reader(buffer, writer.bytes_written());
+        reader.set_string_heap(&heap);
+        REQUIRE(reader.decode(decoded));
+        pson_object& first = *((pson_array&)decoded["readings"])[0];
+        first["status"] = "a new status that is allocated";
+        REQUIRE(!first["status"].is_reference());
+        REQUIRE(heap.intern("degrees celsius", 15)==(const char*)first["unit"]);
+        REQUIRE(heap.strings()==4);
+        decoded = 0;
+        heap.clear();
+        REQUIRE(heap.bytes()==0);
+    }
+}
+
+TEST_CASE( "PSON Recycled Decoding", "[PSON]" ) {
+    auto encode_message = [](uint8_t* buffer, size_t size, int sequence, int readings){
+        memory_writer writer(buffer, size);
+        pson message;
+        message["device_identifier"] = "thermostat-living-room";
+        message["sequence"] = sequence;
+        message["status"] = sequence % 2 ? "operational" : "maintenance";
+        message["payload"].set_bytes((const uint8_t*) "0123456789", 10);
+        pson_array& values = message["readings"];
+        for(int i=0; i<readings; i++){
+            pson_object& reading = values.add_object();
+            reading["temperature_celsius"] = 20.5 + i;
+            reading["unit"] = "degrees celsius";
+        }
+        writer.encode(message);
+        return writer.bytes_written();
+    };
+
+    uint8_t buffer[1024];
+    pson message;
+    memory_reader warmup(buffer, encode_message(buffer, sizeof(buffer), 0, 8));
+    warmup.set_recycle(true);
+    REQUIRE(warmup.decode(message));
+
+    SECTION("same shaped messages are decoded without allocations") {
+        for(int sequence=1; sequence<10; sequence++){
+            size_t size = encode_message(buffer, sizeof(buffer), sequence, 8);
+            size_t allocations = alloc.allocations;
+            memory_reader reader(buffer, size);
+            reader.set_recycle(true);
+            REQUIRE(reader.decode(message));
+            REQUIRE(alloc.allocations==allocations);
+            REQUIRE((int)message["sequence"]==sequence);
+            REQUIRE(std::string((const char*)message["status"])==(sequence % 2 ? "operational" : "maintenance"));
+        }
+        pson_array& readings = message["readings"];
+        REQUIRE(readings.size()==8);
+        REQUIRE((double)(*(pson_object*)readings[7]->get_value())["temperature_celsius"]==27.5);
+    }
+
+    SECTION("surplus items are kept as spares") {
+        size_t size = encode_message(buffer, sizeof(buffer), 1, 3);
+        memory_reader shorter(buffer, size);
+        shorter.set_recycle(true);
+        REQUIRE(shorter.decode(message));
+        pson_array& readings = message["readings"];
+        REQUIRE(readings.size()==3);
+        REQUIRE(readings.spare()==5);
+
+        size = encode_message(buffer, sizeof(buffer), 2, 8);
+        size_t allocations = alloc.allocations;
+        memory_reader longer(buffer, size);
+        longer.set_recycle(true);
+        REQUIRE(longer.decode(message));
+        REQUIRE(alloc.allocations==allocations);
+        REQUIRE(readings.size()==8);
+        REQUIRE(readings.spare()==0);
+
+        // new items never see the contents of the spares
+        memory_reader again(buffer, encode_message(buffer, sizeof(buffer), 3, 3));
+        again.set_recycle(true);
+        REQUIRE(again.decode(message));
+        REQUIRE(readings.add(1).size()==4);
+        REQUIRE(readings[3]->get_type()==pson::one_field);
+        REQUIRE(readings.spare()==4);
+        REQUIRE(readings.pop());
+        REQUIRE(readings.spare()==0);
+    }
+
+    SECTION("a different message shape replaces the tree") {
+        memory_reader reader(buffer, encode_message(buffer, sizeof(buffer), 3, 2));
+        reader.set_recycle(true);
+        pson other;
+        other["readings"] = "not an array";
+        REQUIRE(reader.decode(other));
+        REQUIRE(((pson_array&)other["readings"]).size()==2);
+        REQUIRE(other["readings"].is_array());
+    }
+
+    SECTION("clear keeps the capacity") {
+        pson_array& readings = message["readings"];
+        size_t capacity = readings.capacity();
+        readings.clear();
+        REQUIRE(readings.size()==0);
+        REQUIRE(readings.capacity()==capacity);
+        size_t allocations = alloc.allocations;
+        readings.add(1).add(2);
+        REQUIRE(alloc.allocations==allocations);
+    }
+}
+
+TEST_CASE( "PSON Event Walking", "[PSON]" ) {
+    // handler that aggregates a document without building it
+    struct aggregator : public pson_handler {
+        int64_t sum = 0;
+        double reals = 0;
+        size_t strings = 0;
+        size_t depth = 0;
+        size_t max_depth = 0;
+        std::string keys;
+        std::string longest;
+
+        virtual bool integer(uint64_t magnitude, bool negative){
+            sum += negative ? -(int64_t) magnitude : (int64_t) magnitude;
+            return true;
+        }
+
+        virtual bool real(double value){
+            reals += value;
+            return true;
+        }
+
+        virtual bool string(const char* str, size_t size){
+            strings++;
+            if(size>longest.size()) longest.assign(str, size);
+            return true;
+        }
+
+        virtual bool key(const char* name, size_t size){
+            keys.append(name, size).append(",");
+            return true;
+        }
+
+        virtual bool start_object(){
+            max_depth = std::max(max_depth, ++depth);
+            return true;
+        }
+
+        virtual bool end_object(){
+            depth--;
+            return true;
+        }
+    };
+
+    const std::string long_string(100, 'x');
+    uint8_t buffer[1024];
+    memory_writer writer(buffer, sizeof(buffer));
+    pson document;
+    document["id"] = 42;
+    document["offset"] = -7;
+    document["ratio"] = 0.25;
+    document["precise"] = 1234567.891;
+    document["name"] = "sensor \"one\"\n";
+    document["long"] = long_string.c_str();
+    document["empty"] = "";
+    document["flag"] = true;
+    document["nothing"].set_null();
+    document["raw"].set_bytes((const uint8_t*) "\x01\x02", 2);
+    pson_array& values = document["values"];
+    values.add(1).add(0).add(-100).add("text");
+    pson_object& nested = values.add_object();
+    nested["inner"] = 5;
+    nested["list"] = "x";
+    writer.encode(document);
+
+    SECTION("handlers receive every value in order") {
+        aggregator handler;
+        memory_reader reader(buffer, writer.bytes_written());
+        REQUIRE(reader.walk(handler));
+        REQUIRE(reader.bytes_read()==writer.bytes_written());
+        REQUIRE(handler.sum==42 - 7 + 1 - 100 + 5);
+        REQUIRE(handler.reals==0.25 + 1234567.891);
+        REQUIRE(handler.strings==5);
+        REQUIRE(handler.longest==long_string);
+        REQUIRE(handler.max_depth==2);
+        REQUIRE(handler.depth==0);
+        REQUIRE(handler.keys=="id,offset,ratio,precise,name,long,empty,flag,nothing,raw,values,inner,list,");
+    }
+
+    SECTION("payloads are copied when the input cannot be referenced") {
+        struct stream_reader : public pson_decoder {
+            const uint8_t* buffer_;
+            size_t size_;
+            stream_reader(const uint8_t* buffer, size_t size) : buffer_(buffer), size_(size) {
+            }
+            virtual bool read(void* buffer, size_t size){
+                if(read_+size>size_) return false;
+                memcpy(buffer, &buffer_[read_], size);
+                return pson_decoder::read(buffer, size);
+            }
+        };
+        aggregator handler;
+        stream_reader reader(buffer, writer.bytes_written());
+        REQUIRE(reader.walk(handler));
+        REQUIRE(handler.longest==long_string);
+
+        stream_reader truncated(buffer, writer.bytes_written() - 1);
+        REQUIRE_FALSE(truncated.walk(handler));
+    }
+
+    SECTION("inputs handed to the decoder are read directly") {
+        struct input_reader : public pson_decoder {
+            input_reader(const uint8_t* buffer, size_t size){
+                set_input(buffer, size);
+            }
+        };
+        aggregator handler;
+        input_reader reader(buffer, writer.bytes_written());
+        REQUIRE(reader.walk(handler));
+        REQUIRE(handler.longest==long_string);
+        REQUIRE(handler.sum==42 - 7 + 1 - 100 + 5);
+
+        pson decoded;
+        input_reader decoder(buffer, writer.bytes_written());
+        decoder.set_zero_copy(true);
+        REQUIRE(decoder.decode(decoded));
+        REQUIRE(decoded["long"].is_reference());
+        ostringstream expected, result;
+        json_encoder(expected).encode(document);
+        json_encoder(result).encode(decoded);
+        REQUIRE(result.str()==expected.str());
+
+        for(size_t size=0; size<writer.bytes_written(); size++){
+            input_reader truncated(buffer, size);
+            pson partial;
+            REQUIRE_FALSE(truncated.decode(partial));
+            input_reader truncated_walk(buffer, size);
+            REQUIRE_FALSE(truncated_walk.walk(handler));
+        }
+    }
+
+    SECTION("handlers can stop the walk") {
+        struct first_string : public pson_handler {
+            std::string value;
+            virtual bool string(const char* str, size_t size){
+                value.assign(str, size);
+                return false;
+            }
+        } handler;
+        memory_reader reader(buffer, writer.bytes_written());
+        REQUIRE_FALSE(reader.walk(handler));
+        REQUIRE(handler.value=="sensor \"one\"\n");
+        REQUIRE(reader.bytes_read()<writer.bytes_written());
+    }
+
+    SECTION("the JSON transcoder matches the JSON encoder") {
+        struct memory_transcoder : public pson_json_transcoder {
+            const uint8_t* buffer_;
+            size_t size_;
+            memory_transcoder(std::ostream& stream, const uint8_t* buffer, size_t size) : pson_json_transcoder(stream), buffer_(buffer), size_(size) {
+            }
+            virtual bool read(void* buffer, size_t size){
+                if(read_+size>size_) return false;
+                memcpy(buffer, &buffer_[read_], size);
+                return pson_decoder::read(buffer, size);
+            }
+        };
+        ostringstream transcoded;
+        memory_transcoder transcoder(transcoded, buffer, writer.bytes_written());
+        REQUIRE(transcoder.transcode_value());
+
+        ostringstream encoded;
+        json_encoder encoder(encoded);
+        encoder.encode(document);
+        REQUIRE(transcoded.str()==encoded.str());
+    }
+}
+
+TEST_CASE( "JSON Parser", "[PSON-JSON]" ) {
+    json_parser parser;
+
+    SECTION("values are parsed into pson") {
+        pson value;
+        REQUIRE(parser.parse(" { \"id\" : 42, \"offset\":-7, \"big\":18446744073709551615, \"min\":-9223372036854775808,"
+                             "\"ratio\":0.25, \"exp\":1e3, \"precise\":1234567.891, \"huge\":1e300, \"overflow\":18446744073709551616,"
+                             "\"flag\":true, \"off\":false, \"nothing\":null, \"empty\":\"\", \"list\":[1,[],{}],"
+                             "\"text\":\"tab\\tquote\\\"slash\\/\\u00e9\\ud83d\\ude00\" }\n", value));
+        REQUIRE((int)value["id"]==42);
+        REQUIRE((int)value["offset"]==-7);
+        REQUIRE((uint64_t)value["big"]==UINT64_MAX);
+        REQUIRE((int64_t)value["min"]==INT64_MIN);
+        REQUIRE((double)value["ratio"]==0.25);
+        REQUIRE((int)value["exp"]==1000);
+        REQUIRE((double)value["precise"]==1234567.891);
+        REQUIRE((double)value["huge"]==1e300);
+        REQUIRE((double)value["overflow"]==18446744073709551616.0);
+        REQUIRE((bool)value["flag"]);
+        REQUIRE_FALSE((bool)value["off"]);
+        REQUIRE(value["nothing"].is_null());
+        REQUIRE(value["empty"].get_type()==pson::empty_string);
+        REQUIRE(std::string((const char*)value["text"])=="tab\tquote\"slash/\xc3\xa9\xf0\x9f\x98\x80");
+        REQUIRE(to_json(value["list"])=="[1,[],{}]");
+        pson_object& object = value;
+        REQUIRE(object.size()==15);
+        // keys keep their document order
+        std::string keys;
+        for(pson_object::iterator it = object.begin(); it.valid(); it.next()){
+            keys.append(it.item().name()).append(",");
+        }
+        REQUIRE(keys=="id,offset,big,min,ratio,exp,precise,huge,overflow,flag,off,nothing,empty,list,text,");
+    }
+
+    SECTION("scalars, escaped keys and sized input") {
+        pson value;
+        REQUIRE(parser.parse("\"root string\"", value));
+        REQUIRE(std::string((const char*)value)=="root string");
+        REQUIRE(parser.parse("{\"a \\\"long\\\" key name\":1}", value));
+        REQUIRE(to_json(value)=="{\"a \\\"long\\\" key name\":1}");
+        REQUIRE(parser.parse("12345", 3, value));
+        REQUIRE((int)value==123);
+        REQUIRE(parser.parse("-0", value));
+        REQUIRE(value.get_type()==pson::zero_field);
+    }
+
+    SECTION("key order and duplicates differ from json_decoder::parse") {
+        std::string json = "{\"b\":1,\"a\":2,\"b\":3}";
+        pson native;
+        REQUIRE(json_decoder::parse_native(json, native));
+        REQUIRE(to_json(native)=="{\"b\":1,\"a\":2,\"b\":3}");
+        REQUIRE((int)native["b"]==1);
+
+        // json_decoder::parse and parse_sax keep nlohmann::json semantics: sorted keys, the last duplicate wins
+        pson sorted, sax;
+        REQUIRE(json_decoder::parse(json, sorted));
+        REQUIRE(json_decoder::parse_sax(json, sax));
+        REQUIRE(to_json(sorted)=="{\"a\":2,\"b\":3}");
+        REQUIRE(to_json(sax)==to_json(sorted));
+    }
+
+    SECTION("invalid documents are rejected") {
+        const char* invalid[] = {
+            "", " ", "{", "}", "[1,]", "[,1]", "{\"a\":}", "{\"a\" 1}", "{a:1}", "{\"a\":1,}", "[1 2]", "1 2",
+            "01", "1.", ".5", "-", "1e", "+1", "tru", "nul", "\"open", "\"\\x\"", "\"\\u12\"", "\"\\ud800\"",
+            "\"\\udc00\"", "\"line\nbreak\"", "[\"a\"]]", "1e400", "-1e400", "[2e308]"
+        };
+        for(const char* json : invalid){
+            pson value;
+            INFO(json);
+            REQUIRE_FALSE(parser.parse(json, value));
+        }
+    }
+
+    SECTION("nesting is bounded") {
+        std::string nested(300, '[');
+        nested.append(300, ']');
+        pson value;
+        REQUIRE_FALSE(parser.parse(nested.c_str(), value));
+        parser.set_max_depth(300);
+        REQUIRE(parser.parse(nested.c_str(), value));
+    }
+
+    SECTION("nodes are allocated once") {
+        const char* json = "{\"device_identifier\":\"thermostat-living-room\",\"readings\":[{\"temperature_celsius\":20.5,"
+                           "\"unit\":\"degrees celsius\"},{\"temperature_celsius\":21.5,\"unit\":\"degrees celsius\"}]}";
+        pson parsed;
+        size_t allocations = alloc.allocations;
+        REQUIRE(parser.parse(json, parsed));
+        size_t parse_allocations = alloc.allocations - allocations;
+
+        uint8_t buffer[512];
+        memory_writer writer(buffer, sizeof(buffer));
+        writer.encode(parsed);
+        pson decoded;
+        allocations = alloc.allocations;
+        memory_reader reader(buffer, writer.bytes_written());
+        REQUIRE(reader.decode(decoded));
+        REQUIRE(parse_allocations==alloc.allocations - allocations);
+        REQUIRE(to_json(decoded)==json);
+    }
+}
+
+TEST_CASE( "JSON SAX Decoder", "[PSON-JSON]" ) {
+    // types of every value, depth first, to compare the representations chosen for numbers
+    std::function<void(pson&, std::string&)> types = [&](pson& value, std::string& result){
+        result += std::to_string(value.get_type()) + ",";
+        if(value.is_object()){
+            for(pson_object::iterator it = ((pson_object&) value).begin(); it.valid(); it.next()){
+                types(it.item().value(), result);
+            }
+        }else if(value.is_array()){
+            for(pson_array::iterator it = ((pson_array&) value).begin(); it.valid(); it.next()){
+                types(it.item(), result);
+            }
+        }
+    };
+
+    SECTION("results match to_pson") {
+        const char* documents[] = {
+            "{\"zeta\":1,\"alpha\":-2,\"mid\":{\"b\":[1,2.5,\"x\",null,true,false,{}],\"a\":[]},\"alpha\":3}",
+            "[18446744073709551615,-9223372036854775808,0,1,-1,0.1,1e300,123456789012,\"\",{\"\":\"empty key\"}]",
+            "\"a root string\"",
+            "42",
+            "{\"nested\":{\"deeper\":{\"deepest\":[[[\"value\"]]]}},\"escaped\":\"tab\\tquote\\\"\\u00e9\"}"
+        };
+        for(const char* json : documents){
+            INFO(json);
+            pson expected;
+            nlohmann::to_pson(nlohmann::json::parse(json), expected);
+            pson decoded;
+            REQUIRE(json_decoder::parse_sax(json, decoded));
+            REQUIRE(to_json(decoded)==to_json(expected));
+            std::string decoded_types, expected_types;
+            types(decoded, decoded_types);
+            types(expected, expected_types);
+            REQUIRE(decoded_types==expected_types);
+        }
+    }
+
+    SECTION("duplicated keys keep the last value") {
+        pson decoded;
+        REQUIRE(json_decoder::parse_sax("{\"b\":{\"x\":1},\"a\":0,\"b\":[2]}", decoded));
+        REQUIRE(to_json(decoded)=="{\"a\":0,\"b\":[2]}");
+        // objects are not left with sorted insertions
+        decoded["0"] = 1;
+        REQUIRE(to_json(decoded)=="{\"a\":0,\"b\":[2],\"0\":1}");
+    }
+
+    SECTION("invalid documents are rejected") {
+        const char* invalid[] = { "", "{", "[1,]", "{\"a\":}", "tru", "\"open", "1 2" };
+        for(const char* json : invalid){
+            INFO(json);
+            pson decoded;
+            REQUIRE_FALSE(json_decoder::parse_sax(json, decoded));
+        }
+    }
+}
@@ -26,6 +26,7 @@
 #include <sstream>
 #include "../src/pson.h"
 #include "../src/util/json_decoder.hpp"
+#include "../src/util/mmap_allocator.hpp"
 
 using namespace std;
 using namespace protoson;
@@ -41,10 +42,52 @@ protected:
     }
 };
 
+static void print_stats(const instrumented_memory_allocator::statistics& stats){
+    cerr << "allocations: " << stats.allocations << " (" << stats.failed_allocations << " failed)" << endl;
+    cerr << "allocated bytes: " << stats.allocated_bytes << endl;
+    cerr << "live bytes: " << stats.live_bytes << endl;
+    cerr << "peak bytes: " << stats.peak_bytes << endl;
+    for(size_t i=0; i<instrumented_memory_allocator::histogram_size; i++){
+        if(stats.histogram[i]==0) continue;
+        if(i+1<instrumented_memory_allocator::histogram_size){
+            cerr << "  <= " << ((size_t)1 << i);
+        }else{
+            cerr << "  >  " << ((size_t)1 << (i-1));
+        }
+        cerr << " bytes: " << stats.histogram[i] << endl;
+    }
+}
+
+// usage: json2pson [--native] [--stats] [--mmap | --hugepages] [file]
 int main(int argc, char **argv) {
 
     string json;
 
+    // --native parses with json_parser instead of nlohmann::json, keeping keys in document order and
+    // duplicated keys, and reporting the offset of invalid input
+    // --stats reports allocator statistics of the conversion on stderr
+    // --mmap allocates the document from mmap regions, --hugepages also backs them with huge pages
+    bool native = false;
+    bool stats = false;
+    bool use_mmap = false;
+    bool huge_pages = false;
+    while(argc>1 && string(argv[1]).compare(0, 2, "--")==0){
+        string option(argv[1]);
+        if(option=="--native"){
+            native = true;
+        }else if(option=="--stats"){
+            stats = true;
+        }else if(option=="--mmap" || option=="--hugepages"){
+            use_mmap = true;
+            huge_pages = option=="--hugepages";
+        }else{
+            cerr << "unknown option " << option << endl;
+            return -1;
+        }
+        argc--;
+        argv++;
+    }
+
     // read input from cin
     if(argc==1){
         string lineInput;
@@ -58,19 +101,24 @@ int main(int argc, char **argv) {
         json = buffer.str();
     }
 
-    // parse and decode json
-    nlohmann::json jsonValue;
-    try{
-        jsonValue = nlohmann::json::parse(json);
-    }catch(std::invalid_argument e){
+    // parse json into pson, instrumenting the allocator so the memory used can be reported
+    mmap_memory_allocator mmap_allocator(64 << 20, huge_pages);
+    instrumented_memory_allocator instrumented(use_mmap ? (memory_allocator&) mmap_allocator : alloc);
+    pson value;
+    value.set_allocator(instrumented);
+    if(native){
+        json_parser parser;
+        if(!parser.parse(json.data(), json.size(), value)){
+            cerr << "invalid json at offset " << parser.position() << endl;
+            return -1;
+        }
+    }else if(!json_decoder::parse(json, value)){
+        cerr << "invalid json" << endl;
         return -1;
     }
-
-    // convert json to pson
-    pson value;
-    nlohmann::to_pson(jsonValue, value);
-
-    //std::cout << std::setw(4) << jsonValue << std::endl;
+    if(stats){
+        print_stats(instrumented.stats());
+    }
 
     // encode pson to binary
     cout_writter writter;
@@ -24,6 +24,7 @@
 #include <iostream>
 #include <fstream>
 #include "../src/util/json_encoder.hpp"
+#include "../src/util/mmap_allocator.hpp"
 
 using namespace std;
 using namespace protoson;
@@ -57,18 +58,46 @@ private:
     std::ifstream file_;
 };
 
+// usage: pson2json [--mmap | --hugepages] [--dedup] [file]
 int main(int argc, char **argv) {
+    // --mmap decodes the document into mmap regions, --hugepages also backs them with huge pages
+    bool use_mmap = false;
+    bool huge_pages = false;
+    // --dedup stores the decoded strings once, in a contiguous string heap
+    bool dedup = false;
+    while(argc>1 && string(argv[1]).compare(0, 2, "--")==0){
+        string option(argv[1]);
+        if(option=="--mmap" || option=="--hugepages"){
+            use_mmap = true;
+            huge_pages = option=="--hugepages";
+        }else if(option=="--dedup"){
+            dedup = true;
+        }else{
+            cerr << "unknown option " << option << endl;
+            return -1;
+        }
+        argc--;
+        argv++;
+    }
+
+    mmap_memory_allocator mmap_allocator(64 << 20, huge_pages);
+    pson_string_heap heap(use_mmap ? (memory_allocator&) mmap_allocator : alloc, 64 << 10);
     pson value;
+    if(use_mmap){
+        value.set_allocator(mmap_allocator);
+    }
 
     // read input from cin
     if(argc==1){
         pson_cin_reader reader;
+        if(dedup) reader.set_string_heap(&heap);
         if(!reader.decode(value)){
             std::cerr << "invalid format" << std::endl;
             return -1;
         }
     }else{
         pson_file_reader reader(argv[1]);
+        if(dedup) reader.set_string_heap(&heap);
         if(!reader.decode(value)){
             std::cerr << "invalid format" << std::endl;
             return -1;